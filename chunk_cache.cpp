@@ -0,0 +1,522 @@
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <filesystem>
+#include <fstream>
+#include <stdexcept>
+#include <thread>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <boost/asio/post.hpp>
+#include <boost/beast/http/error.hpp>
+#include <spdlog/spdlog.h>
+#include "chunk_cache.hpp"
+#include "compression.hpp"
+
+namespace
+{
+
+// Name of a chunk in both tiers: the entity tag without quotes and the
+// chunk index, e.g. "1a2b-17f3c0d2e4a51b00-8000000.3"
+std::string
+chunk_key(std::string const& etag, std::uint64_t index)
+{
+  auto key = etag.substr(1, etag.size() - 2);
+  key += '.';
+  key += std::to_string(index);
+  return key;
+}
+
+} // namespace
+
+//------------------------------------------------------------------------------
+
+bool
+s3fifo::touch(std::string const& key)
+{
+  auto const it = index_.find(key);
+  if (it == index_.end())
+    return false;
+  it->second->freq = std::min(it->second->freq + 1, 3);
+  return true;
+}
+
+bool
+s3fifo::insert(std::string const& key, std::size_t size, bool read, std::vector<std::string>& evicted)
+{
+  if (size > capacity_)
+    return false;
+  if (index_.count(key))
+    return true;
+
+  // Evicted from the small FIFO not long ago: it is read again
+  auto const ghost = ghost_index_.find(key);
+  if (ghost != ghost_index_.end())
+  {
+    ghost_size_ -= ghost->second->size;
+    ghost_.erase(ghost->second);
+    ghost_index_.erase(ghost);
+    main_.push_back(entry{ key, size, 0, true });
+    index_[key] = std::prev(main_.end());
+    main_size_ += size;
+  }
+  else
+  {
+    small_.push_back(entry{ key, size, read ? 0 : -1, false });
+    index_[key] = std::prev(small_.end());
+    small_size_ += size;
+  }
+
+  while (small_size_ + main_size_ > capacity_)
+    evict(evicted);
+  return true;
+}
+
+void
+s3fifo::erase(std::string const& key)
+{
+  auto const it = index_.find(key);
+  if (it == index_.end())
+    return;
+  auto const in_main = it->second->main;
+  (in_main ? main_size_ : small_size_) -= it->second->size;
+  (in_main ? main_ : small_).erase(it->second);
+  index_.erase(it);
+}
+
+void
+s3fifo::evict(std::vector<std::string>& evicted)
+{
+  if (!small_.empty() && (small_size_ > capacity_ / 10 || main_.empty()))
+  {
+    auto it = small_.begin();
+    small_size_ -= it->size;
+    if (it->freq > 0)
+    {
+      it->freq = 0;
+      it->main = true;
+      main_size_ += it->size;
+      main_.splice(main_.end(), small_, it);
+      return;
+    }
+    evicted.push_back(it->key);
+    index_.erase(it->key);
+    remember(std::move(*it));
+    small_.erase(it);
+    return;
+  }
+
+  auto it = main_.begin();
+  if (it->freq > 0)
+  {
+    --it->freq;
+    main_.splice(main_.end(), main_, it);
+    return;
+  }
+  main_size_ -= it->size;
+  evicted.push_back(it->key);
+  index_.erase(it->key);
+  main_.erase(it);
+}
+
+void
+s3fifo::remember(entry e)
+{
+  ghost_size_ += e.size;
+  ghost_.push_back(std::move(e));
+  ghost_index_[ghost_.back().key] = std::prev(ghost_.end());
+
+  // Remember as many bytes as fit in the cache
+  while (ghost_size_ > capacity_)
+  {
+    ghost_size_ -= ghost_.front().size;
+    ghost_index_.erase(ghost_.front().key);
+    ghost_.pop_front();
+  }
+}
+
+//------------------------------------------------------------------------------
+
+chunk_cache::chunk_cache(chunk_cache_config const& config)
+  : config_(config)
+  , ram_(config.ram_capacity)
+  , disk_(config.disk_dir.empty() ? 0 : config.disk_capacity)
+  , pool_(std::max<std::size_t>(1, config.threads))
+{
+  if (config_.chunk_size == 0)
+    throw std::invalid_argument("chunk size must not be 0");
+  if (!config_.disk_dir.empty())
+    scan_disk();
+}
+
+chunk_cache::counters
+chunk_cache::stats()
+{
+  std::lock_guard<std::mutex> lock(mutex_);
+  return counters{ hits_, disk_hits_, misses_ };
+}
+
+bool
+chunk_cache::lookup(std::string const& path, cached_file& file)
+{
+  std::lock_guard<std::mutex> lock(mutex_);
+  auto const it = files_.find(path);
+  if (it == files_.end() || std::chrono::steady_clock::now() - it->second.checked >= config_.stat_ttl)
+    return false;
+  file = it->second.file;
+  return true;
+}
+
+void
+chunk_cache::async_lookup(std::string const& path, lookup_handler handler)
+{
+  net::post(pool_,
+    [this, path, handler = std::move(handler)]
+    {
+      if (config_.origin_delay.count())
+        std::this_thread::sleep_for(config_.origin_delay);
+
+      auto const now = std::chrono::steady_clock::now();
+      struct stat st;
+      beast::error_code ec;
+      if (::stat(path.c_str(), &st) != 0)
+        ec.assign(errno, beast::system_category());
+      else if (!S_ISREG(st.st_mode))
+        ec = beast::errc::make_error_code(beast::errc::is_a_directory);
+      if (ec)
+      {
+        {
+          std::lock_guard<std::mutex> lock(mutex_);
+          files_.erase(path);
+        }
+        return handler({}, ec);
+      }
+
+      cached_file file{ path, entity_tag(st), static_cast<std::uint64_t>(st.st_size) };
+      {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (files_.size() >= max_files)
+          files_.clear();
+        files_[path] = file_info{ file, now };
+      }
+      handler(std::move(file), {});
+    });
+}
+
+std::shared_ptr<std::string const>
+chunk_cache::find(cached_file const& file, std::uint64_t index)
+{
+  auto const key = chunk_key(file.etag, index);
+  std::lock_guard<std::mutex> lock(mutex_);
+  auto const cached = chunks_.find(key);
+  if (cached == chunks_.end())
+    return nullptr;
+  ram_.touch(key);
+  ++hits_;
+  return cached->second;
+}
+
+void
+chunk_cache::async_read(cached_file const& file, std::uint64_t index, net::any_io_executor ex, read_handler handler)
+{
+  auto const key = chunk_key(file.etag, index);
+  std::unique_lock<std::mutex> lock(mutex_);
+  auto const cached = chunks_.find(key);
+  if (cached != chunks_.end())
+  {
+    ram_.touch(key);
+    ++hits_;
+    auto data = cached->second;
+    lock.unlock();
+    return net::post(ex,
+      [handler = std::move(handler), data = std::move(data)]
+      {
+        handler(data, {});
+      });
+  }
+
+  // Someone is reading it already, wait for that read
+  auto& l = pending_[key];
+  bool const started = l != nullptr;
+  if (!started)
+    l = std::make_shared<pending_load>();
+  else
+    ++hits_;
+  l->read = true;
+  l->waiters.emplace_back(std::move(ex), std::move(handler));
+  lock.unlock();
+
+  if (!started)
+    net::post(pool_,
+      [this, file, index]
+      {
+        load(file, index);
+      });
+}
+
+void
+chunk_cache::read_ahead(cached_file const& file, std::uint64_t index)
+{
+  if (index * config_.chunk_size >= file.size)
+    return;
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto const key = chunk_key(file.etag, index);
+    if (chunks_.count(key) || pending_.count(key))
+      return;
+    pending_[key] = std::make_shared<pending_load>();
+  }
+  net::post(pool_,
+    [this, file, index]
+    {
+      load(file, index);
+    });
+}
+
+void
+chunk_cache::load(cached_file const& file, std::uint64_t index)
+{
+  auto const key = chunk_key(file.etag, index);
+  auto const size = static_cast<std::size_t>(
+    std::min<std::uint64_t>(config_.chunk_size, file.size - index * config_.chunk_size));
+
+  std::unique_lock<std::mutex> lock(mutex_);
+  auto const on_disk = disk_.contains(key);
+  if (on_disk && pending_.at(key)->read)
+    disk_.touch(key);
+  lock.unlock();
+
+  beast::error_code ec;
+  std::shared_ptr<std::string const> data;
+  if (on_disk)
+  {
+    data = read_disk(key, size);
+    if (!data)
+    {
+      lock.lock();
+      disk_.erase(key);
+      lock.unlock();
+    }
+  }
+  auto const from_origin = !data;
+  if (from_origin)
+  {
+    data = read_origin(file, index, ec);
+    if (data && !config_.disk_dir.empty())
+      write_disk(key, *data);
+  }
+
+  lock.lock();
+  auto const node = pending_.extract(key);
+  auto const& l = *node.mapped();
+  if (data)
+  {
+    ++(from_origin ? misses_ : disk_hits_);
+
+    std::vector<std::string> evicted;
+    if (ram_.insert(key, size, l.read, evicted))
+      chunks_[key] = data;
+    for (auto const& k : evicted)
+      chunks_.erase(k);
+
+    // The disk tier is written through, its own FIFOs keep
+    // the chunks read once from flushing it
+    if (from_origin && !config_.disk_dir.empty())
+    {
+      evicted.clear();
+      if (!disk_.insert(key, size, l.read, evicted))
+        evicted.push_back(key);
+      for (auto const& k : evicted)
+        std::remove(disk_path(k).c_str());
+    }
+
+    spdlog::debug("Chunk {} of {} from {} ({} hits, {} from disk, {} misses)",
+      index, file.path, from_origin ? "doc_root" : "disk", hits_, disk_hits_, misses_);
+  }
+  lock.unlock();
+
+  for (auto const& w : l.waiters)
+    net::post(w.first,
+      [handler = w.second, data, ec]
+      {
+        handler(data, ec);
+      });
+}
+
+std::shared_ptr<std::string const>
+chunk_cache::read_origin(cached_file const& file, std::uint64_t index, beast::error_code& ec)
+{
+  if (config_.origin_delay.count())
+    std::this_thread::sleep_for(config_.origin_delay);
+
+  int const fd = ::open(file.path.c_str(), O_RDONLY | O_CLOEXEC);
+  if (fd < 0)
+  {
+    ec.assign(errno, beast::system_category());
+    return nullptr;
+  }
+
+  auto const offset = index * config_.chunk_size;
+  auto const size = static_cast<std::size_t>(
+    std::min<std::uint64_t>(config_.chunk_size, file.size - offset));
+  auto data = std::make_shared<std::string>(size, '\0');
+  std::size_t got = 0;
+  while (got < size)
+  {
+    auto const n = ::pread(fd, &(*data)[got], size - got, static_cast<off_t>(offset + got));
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n < 0)
+    {
+      ec.assign(errno, beast::system_category());
+      break;
+    }
+    // The file got shorter since it was opened
+    if (n == 0)
+    {
+      ec = beast::errc::make_error_code(beast::errc::io_error);
+      break;
+    }
+    got += static_cast<std::size_t>(n);
+  }
+  ::close(fd);
+  if (ec)
+    return nullptr;
+  return data;
+}
+
+std::shared_ptr<std::string const>
+chunk_cache::read_disk(std::string const& key, std::size_t size)
+{
+  std::ifstream file(disk_path(key), std::ios::binary);
+  auto data = std::make_shared<std::string>(size, '\0');
+  file.read(&(*data)[0], static_cast<std::streamsize>(size));
+  if (static_cast<std::size_t>(file.gcount()) != size || file.peek() != std::ifstream::traits_type::eof())
+  {
+    spdlog::debug("Dropping the bad chunk {} from the disk tier", key);
+    return nullptr;
+  }
+  return data;
+}
+
+void
+chunk_cache::write_disk(std::string const& key, std::string const& data)
+{
+  // Written aside then renamed, so a chunk is complete once it has its name
+  auto const path = disk_path(key);
+  auto const tmp = path + ".tmp";
+  {
+    std::ofstream file(tmp, std::ios::binary | std::ios::trunc);
+    file.write(data.data(), static_cast<std::streamsize>(data.size()));
+    if (file.good())
+    {
+      file.close();
+      if (std::rename(tmp.c_str(), path.c_str()) == 0)
+        return;
+    }
+  }
+  spdlog::debug("Failed to write the chunk {} to the disk tier", key);
+  std::remove(tmp.c_str());
+}
+
+void
+chunk_cache::scan_disk()
+{
+  namespace fs = std::filesystem;
+
+  std::error_code ec;
+  fs::create_directories(config_.disk_dir, ec);
+  std::vector<std::string> evicted;
+  std::size_t found = 0;
+  for (auto const& e : fs::directory_iterator(config_.disk_dir, ec))
+  {
+    if (!e.is_regular_file(ec))
+      continue;
+    auto const name = e.path().filename().string();
+    if (name.size() > 4 && name.compare(name.size() - 4, 4, ".tmp") == 0)
+    {
+      fs::remove(e.path(), ec);
+      continue;
+    }
+    // Not read yet by this process, so they are the first to go
+    disk_.insert(name, static_cast<std::size_t>(e.file_size(ec)), false, evicted);
+    ++found;
+  }
+  for (auto const& k : evicted)
+    std::remove(disk_path(k).c_str());
+  spdlog::info("Chunk cache: {} chunk(s), {} bytes in {}", found - evicted.size(), disk_.size(), config_.disk_dir);
+}
+
+std::string
+chunk_cache::disk_path(std::string const& key) const
+{
+  return config_.disk_dir + "/" + key;
+}
+
+//------------------------------------------------------------------------------
+
+net::const_buffer
+chunk_reader::data()
+{
+  if (done())
+    return {};
+
+  auto const at = body_.offset + pos_;
+  auto const chunk_size = body_.cache->chunk_size();
+  auto const index = at / chunk_size;
+  if (!chunk_ || index != index_)
+  {
+    index_ = index;
+    chunk_ = body_.cache->find(body_.file, index);
+    if (!chunk_)
+      return {};
+
+    // Read the next chunk while this one is sent
+    if ((index + 1) * chunk_size < body_.offset + body_.length)
+      body_.cache->read_ahead(body_.file, index + 1);
+  }
+
+  auto const begin = static_cast<std::size_t>(at - index * chunk_size);
+  auto const n = static_cast<std::size_t>(
+    std::min<std::uint64_t>(chunk_->size() - std::min(begin, chunk_->size()), body_.length - pos_));
+  return net::const_buffer(chunk_->data() + begin, n);
+}
+
+void
+chunk_reader::async_fetch(net::any_io_executor ex, std::function<void(beast::error_code)> handler)
+{
+  auto const index = (body_.offset + pos_) / body_.cache->chunk_size();
+  body_.cache->async_read(body_.file, index, std::move(ex),
+    [this, index, handler = std::move(handler)](std::shared_ptr<std::string const> chunk, beast::error_code ec)
+    {
+      if (!ec && !chunk)
+        ec = beast::errc::make_error_code(beast::errc::io_error);
+      if (!ec)
+      {
+        index_ = index;
+        chunk_ = std::move(chunk);
+        if ((index + 1) * body_.cache->chunk_size() < body_.offset + body_.length)
+          body_.cache->read_ahead(body_.file, index + 1);
+      }
+      handler(ec);
+    });
+}
+
+//------------------------------------------------------------------------------
+
+boost::optional<std::pair<cached_file_body::writer::const_buffers_type, bool>>
+cached_file_body::writer::get(beast::error_code& ec)
+{
+  ec = {};
+  if (reader_.done())
+    return boost::none;
+  auto const data = reader_.data();
+  if (data.size() == 0)
+  {
+    ec = http::error::need_more;
+    return boost::none;
+  }
+  reader_.consume(data.size());
+  return std::make_pair(data, !reader_.done());
+}
@@ -0,0 +1,320 @@
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include <boost/asio/any_io_executor.hpp>
+#include <boost/asio/buffer.hpp>
+#include <boost/asio/thread_pool.hpp>
+#include <boost/beast/core/error.hpp>
+#include <boost/beast/http/message.hpp>
+#include <boost/optional.hpp>
+
+namespace beast = boost::beast;         // from <boost/beast.hpp>
+namespace http = beast::http;           // from <boost/beast/http.hpp>
+namespace net = boost::asio;            // from <boost/asio.hpp>
+
+// S3-FIFO eviction of byte-sized entries. New entries go to a small
+// FIFO holding a tenth of the capacity; those read again before they
+// reach its end move to the main FIFO, the others are evicted and only
+// their key is remembered in a ghost FIFO. A key coming back from the
+// ghost FIFO goes straight to the main one, whose entries are kept for
+// another round as long as they are read. A file downloaded once thus
+// never pushes the frequently read ones out.
+class s3fifo
+{
+  struct entry
+  {
+    std::string key;
+    std::size_t size;
+    int freq;
+    bool main;
+  };
+
+  std::size_t capacity_;
+  std::size_t small_size_ = 0;
+  std::size_t main_size_ = 0;
+  std::size_t ghost_size_ = 0;
+  std::list<entry> small_;
+  std::list<entry> main_;
+  std::list<entry> ghost_;
+  std::unordered_map<std::string, std::list<entry>::iterator> index_;
+  std::unordered_map<std::string, std::list<entry>::iterator> ghost_index_;
+
+public:
+  explicit s3fifo(std::size_t capacity)
+    : capacity_(capacity)
+  {
+  }
+
+  std::size_t
+    size() const
+  {
+    return small_size_ + main_size_;
+  }
+
+  bool
+    contains(std::string const& key) const
+  {
+    return index_.count(key) != 0;
+  }
+
+  // Count a read, returns `false` if the key isn't cached
+  bool
+    touch(std::string const& key);
+
+  // Add an entry, evicting others until it fits. An entry added before
+  // it is asked for (read ahead) isn't counted as read once. Returns
+  // `false` if it doesn't fit at all.
+  bool
+    insert(std::string const& key, std::size_t size, bool read, std::vector<std::string>& evicted);
+
+  void
+    erase(std::string const& key);
+
+private:
+  void
+    evict(std::vector<std::string>& evicted);
+
+  void
+    remember(entry e);
+};
+
+// A file below doc_root, as seen when a request opened it
+struct cached_file
+{
+  std::string path;
+  std::string etag;
+  std::uint64_t size;
+};
+
+struct chunk_cache_config
+{
+  // Files are cached in chunks of this size, the last one is shorter
+  std::size_t chunk_size = 2 * 1024 * 1024;
+
+  // Bytes of chunks kept in memory
+  std::size_t ram_capacity = 256 * 1024 * 1024;
+
+  // Directory of the local disk tier, none if empty
+  std::string disk_dir;
+  std::uint64_t disk_capacity = 4ull * 1024 * 1024 * 1024;
+
+  // Added to every stat and read of doc_root, to stand in for a slow network mount
+  std::chrono::milliseconds origin_delay{ 0 };
+
+  // How long the size and entity tag of a file are trusted
+  // before doc_root is looked at again
+  std::chrono::milliseconds stat_ttl{ 1000 };
+
+  // Threads reading ahead
+  std::size_t threads = 2;
+};
+
+// A read-through cache of file chunks in front of a slow doc_root: a
+// bounded RAM tier, then an optional tier of files on a local disk,
+// each evicting with S3-FIFO. Chunks are keyed by entity tag, so a
+// modified file is never served from stale chunks. The tiers below
+// are only read on the cache's own threads; concurrent misses on a
+// chunk share a single read.
+class chunk_cache
+{
+public:
+  using read_handler = std::function<void(std::shared_ptr<std::string const>, beast::error_code)>;
+  using lookup_handler = std::function<void(cached_file, beast::error_code)>;
+
+  // Chunks read from memory, from the disk tier and from doc_root
+  struct counters
+  {
+    std::uint64_t hits;
+    std::uint64_t disk_hits;
+    std::uint64_t misses;
+  };
+
+private:
+  // A chunk being read, with the requests waiting for it
+  struct pending_load
+  {
+    bool read = false; // asked for, not only read ahead
+    std::vector<std::pair<net::any_io_executor, read_handler>> waiters;
+  };
+
+  // Files looked up, forgotten all at once past this count
+  static constexpr std::size_t max_files = 65536;
+
+  // The size and entity tag of a file, as of `checked`
+  struct file_info
+  {
+    cached_file file;
+    std::chrono::steady_clock::time_point checked;
+  };
+
+  chunk_cache_config config_;
+  std::mutex mutex_;
+  s3fifo ram_;
+  s3fifo disk_;
+  std::unordered_map<std::string, std::shared_ptr<std::string const>> chunks_;
+  std::unordered_map<std::string, std::shared_ptr<pending_load>> pending_;
+  std::unordered_map<std::string, file_info> files_;
+  std::uint64_t hits_ = 0;
+  std::uint64_t disk_hits_ = 0;
+  std::uint64_t misses_ = 0;
+
+  // Declared last so its threads are joined before the members they use are destroyed
+  net::thread_pool pool_;
+
+public:
+  explicit chunk_cache(chunk_cache_config const& config);
+
+  std::size_t
+    chunk_size() const
+  {
+    return config_.chunk_size;
+  }
+
+  counters
+    stats();
+
+  // Sets the size and entity tag of a regular file below doc_root if
+  // it was looked at within `stat_ttl`. Returns `false` otherwise, the
+  // file must then be looked at with async_lookup.
+  bool
+    lookup(std::string const& path, cached_file& file);
+
+  // Look at a file in doc_root on the cache's threads, then call
+  // `handler` there. Fails if the path isn't a regular file.
+  void
+    async_lookup(std::string const& path, lookup_handler handler);
+
+  // Returns chunk `index` of the file if it is in memory, else nullptr
+  std::shared_ptr<std::string const>
+    find(cached_file const& file, std::uint64_t index);
+
+  // Read chunk `index` of the file on the cache's threads, from the
+  // tiers below on a miss, then post `handler` to `ex`
+  void
+    async_read(cached_file const& file, std::uint64_t index, net::any_io_executor ex, read_handler handler);
+
+  // Read a chunk into the cache in the background if it isn't there
+  void
+    read_ahead(cached_file const& file, std::uint64_t index);
+
+private:
+  void
+    load(cached_file const& file, std::uint64_t index);
+
+  std::shared_ptr<std::string const>
+    read_origin(cached_file const& file, std::uint64_t index, beast::error_code& ec);
+
+  std::shared_ptr<std::string const>
+    read_disk(std::string const& key, std::size_t size);
+
+  void
+    write_disk(std::string const& key, std::string const& data);
+
+  // Index the chunks a previous process left in the disk tier
+  void
+    scan_disk();
+
+  std::string
+    disk_path(std::string const& key) const;
+};
+
+// A response body made of a byte range of a file, read through
+// a chunk_cache one chunk at a time as it is sent. Nothing blocks on
+// a chunk missing from memory: the writer fails with need_more and the
+// session fetches the chunk before it writes again.
+struct cached_file_body
+{
+  struct value_type
+  {
+    chunk_cache* cache = nullptr;
+    cached_file file;
+    std::uint64_t offset = 0;
+    std::uint64_t length = 0;
+  };
+
+  static std::uint64_t
+    size(value_type const& body)
+  {
+    return body.length;
+  }
+
+  class writer;
+};
+
+// Walks the byte range of a cached_file_body. The bytes come from the
+// chunks in memory; a missing chunk is fetched on the cache's threads.
+class chunk_reader
+{
+  cached_file_body::value_type const& body_;
+  std::uint64_t pos_ = 0;
+  std::uint64_t index_ = 0;
+  std::shared_ptr<std::string const> chunk_;
+
+public:
+  explicit chunk_reader(cached_file_body::value_type const& body)
+    : body_(body)
+  {
+  }
+
+  bool
+    done() const
+  {
+    return pos_ >= body_.length;
+  }
+
+  // The bytes at the current position, up to the end of their chunk.
+  // Empty when the range is done or the chunk isn't in memory.
+  net::const_buffer
+    data();
+
+  void
+    consume(std::size_t n)
+  {
+    pos_ += n;
+  }
+
+  // Read the chunk at the current position, then post `handler` to
+  // `ex`. The reader must outlive the operation.
+  void
+    async_fetch(net::any_io_executor ex, std::function<void(beast::error_code)> handler);
+};
+
+class cached_file_body::writer
+{
+  chunk_reader reader_;
+
+public:
+  using const_buffers_type = net::const_buffer;
+
+  template <bool isRequest, class Fields>
+  writer(http::header<isRequest, Fields> const&, value_type const& body)
+    : reader_(body)
+  {
+  }
+
+  void
+    init(beast::error_code& ec)
+  {
+    ec = {};
+  }
+
+  // Fails with http::error::need_more on a chunk missing from memory
+  boost::optional<std::pair<const_buffers_type, bool>>
+    get(beast::error_code& ec);
+
+  // After http::error::need_more, read the missing chunk
+  // then post `handler` to `ex`, the write can go on
+  void
+    async_fetch(net::any_io_executor ex, std::function<void(beast::error_code)> handler)
+  {
+    reader_.async_fetch(std::move(ex), std::move(handler));
+  }
+};
@@ -0,0 +1,255 @@
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <iterator>
+#include <sys/stat.h>
+#include <zlib.h>
+#ifdef HAVE_BROTLI
+#include <brotli/encode.h>
+#endif
+#include <boost/asio/post.hpp>
+#include <boost/core/ignore_unused.hpp>
+#include <spdlog/spdlog.h>
+#include "compression.hpp"
+
+namespace
+{
+
+// Returns an empty string on failure
+std::string
+gzip_compress(std::string const& in)
+{
+  z_stream zs{};
+  // 15 window bits, +16 for a gzip header and trailer
+  if (deflateInit2(&zs, Z_BEST_COMPRESSION, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY) != Z_OK)
+    return {};
+
+  std::string out(deflateBound(&zs, in.size()), '\0');
+  zs.next_in = reinterpret_cast<Bytef*>(const_cast<char*>(in.data()));
+  zs.avail_in = static_cast<uInt>(in.size());
+  zs.next_out = reinterpret_cast<Bytef*>(&out[0]);
+  zs.avail_out = static_cast<uInt>(out.size());
+  auto const rc = deflate(&zs, Z_FINISH);
+  out.resize(zs.total_out);
+  deflateEnd(&zs);
+  return rc == Z_STREAM_END ? out : std::string();
+}
+
+std::string
+brotli_compress(std::string const& in)
+{
+#ifdef HAVE_BROTLI
+  std::size_t size = BrotliEncoderMaxCompressedSize(in.size());
+  if (size == 0)
+    return {};
+  std::string out(size, '\0');
+  if (!BrotliEncoderCompress(
+    BROTLI_MAX_QUALITY, BROTLI_DEFAULT_WINDOW, BROTLI_MODE_TEXT,
+    in.size(), reinterpret_cast<uint8_t const*>(in.data()),
+    &size, reinterpret_cast<uint8_t*>(&out[0])))
+    return {};
+  out.resize(size);
+  return out;
+#else
+  boost::ignore_unused(in);
+  return {};
+#endif
+}
+
+} // namespace
+
+beast::string_view
+coding_name(content_coding coding)
+{
+  switch (coding)
+  {
+  case content_coding::gzip: return "gzip";
+  case content_coding::br: return "br";
+  default: return {};
+  }
+}
+
+beast::string_view
+coding_suffix(content_coding coding)
+{
+  switch (coding)
+  {
+  case content_coding::gzip: return ".gz";
+  case content_coding::br: return ".br";
+  default: return {};
+  }
+}
+
+content_coding
+negotiate_coding(beast::string_view accept_encoding, unsigned available)
+{
+  // q-values in thousandths, -1 when the coding isn't listed
+  int q_gzip = -1, q_br = -1, q_any = -1;
+
+  while (!accept_encoding.empty())
+  {
+    auto const comma = accept_encoding.find(',');
+    auto item = accept_encoding.substr(0, comma);
+    accept_encoding = comma == beast::string_view::npos
+      ? beast::string_view{}
+      : accept_encoding.substr(comma + 1);
+
+    auto const semi = item.find(';');
+    auto name = item.substr(0, semi);
+    while (!name.empty() && name.front() == ' ')
+      name.remove_prefix(1);
+    while (!name.empty() && name.back() == ' ')
+      name.remove_suffix(1);
+
+    int q = 1000;
+    if (semi != beast::string_view::npos)
+    {
+      auto const params = item.substr(semi + 1);
+      auto const pos = params.find("q=");
+      if (pos != beast::string_view::npos)
+        q = static_cast<int>(std::atof(params.substr(pos + 2).to_string().c_str()) * 1000);
+    }
+
+    if (beast::iequals(name, "gzip") || beast::iequals(name, "x-gzip"))
+      q_gzip = q;
+    else if (beast::iequals(name, "br"))
+      q_br = q;
+    else if (name == "*")
+      q_any = q;
+  }
+
+  if (q_gzip < 0)
+    q_gzip = q_any;
+  if (q_br < 0)
+    q_br = q_any;
+  if (!(available & static_cast<unsigned>(content_coding::gzip)))
+    q_gzip = -1;
+  if (!(available & static_cast<unsigned>(content_coding::br)))
+    q_br = -1;
+
+  // Brotli wins ties, it is smaller for text
+  if (q_br > 0 && q_br >= q_gzip)
+    return content_coding::br;
+  if (q_gzip > 0)
+    return content_coding::gzip;
+  return content_coding::identity;
+}
+
+bool
+is_compressible(beast::string_view mime_type)
+{
+  return mime_type.starts_with("text/") ||
+    mime_type == "application/javascript" ||
+    mime_type == "application/json" ||
+    mime_type == "application/xml" ||
+    mime_type == "application/vnd.apple.mpegurl" ||
+    mime_type == "image/svg+xml";
+}
+
+std::string
+entity_tag(std::string const& path)
+{
+  struct stat st;
+  if (::stat(path.c_str(), &st) != 0)
+    return {};
+  return entity_tag(st);
+}
+
+std::string
+entity_tag(struct stat const& st)
+{
+  char buf[64];
+  std::snprintf(buf, sizeof(buf), "\"%llx-%llx-%llx\"",
+    static_cast<unsigned long long>(st.st_ino),
+    static_cast<unsigned long long>(st.st_mtim.tv_sec) * 1000000000ull +
+    static_cast<unsigned long long>(st.st_mtim.tv_nsec),
+    static_cast<unsigned long long>(st.st_size));
+  return buf;
+}
+
+//------------------------------------------------------------------------------
+
+compression_cache::compression_cache(std::size_t capacity, std::size_t max_object, std::size_t threads)
+  : capacity_(capacity), max_object_(max_object), pool_(threads)
+{
+}
+
+unsigned
+compression_cache::codings()
+{
+  unsigned mask = static_cast<unsigned>(content_coding::gzip);
+#ifdef HAVE_BROTLI
+  mask |= static_cast<unsigned>(content_coding::br);
+#endif
+  return mask;
+}
+
+std::shared_ptr<std::string const>
+compression_cache::find_or_compress(
+  std::string const& path,
+  std::string const& etag,
+  std::uint64_t file_size,
+  content_coding coding)
+{
+  auto key = etag + coding_suffix(coding).to_string();
+
+  std::lock_guard<std::mutex> lock(mutex_);
+  auto const it = index_.find(key);
+  if (it != index_.end())
+  {
+    lru_.splice(lru_.begin(), lru_, it->second);
+    return it->second->data;
+  }
+
+  if (file_size <= max_object_ && pending_.insert(key).second)
+    net::post(pool_,
+      [this, path, key = std::move(key), coding]() mutable
+      {
+        compress(std::move(path), std::move(key), coding);
+      });
+  return nullptr;
+}
+
+void
+compression_cache::compress(std::string path, std::string key, content_coding coding)
+{
+  std::ifstream file(path, std::ios::binary);
+  std::string const in{ std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>() };
+  file.peek();
+  auto out = std::make_shared<std::string>(
+    coding == content_coding::br ? brotli_compress(in) : gzip_compress(in));
+
+  // Keep failures as an empty string, they are never served
+  if (!file.eof() || out->size() >= in.size())
+    out->clear();
+  if (out->empty())
+    spdlog::debug("Failed to compress {}", path);
+  else
+    spdlog::debug("Compressed {} ({}): {} -> {} bytes", path, coding_name(coding).to_string(), in.size(), out->size());
+  insert(key, std::move(out));
+}
+
+void
+compression_cache::insert(std::string const& key, std::shared_ptr<std::string const> data)
+{
+  std::lock_guard<std::mutex> lock(mutex_);
+  pending_.erase(key);
+
+  // The key counts too, so failures (empty strings) are evicted as well
+  auto const cost = key.size() + data->size();
+  if (cost > capacity_)
+    return;
+
+  lru_.push_front(entry{ key, data, cost });
+  index_[key] = lru_.begin();
+  size_ += cost;
+
+  while (size_ > capacity_)
+  {
+    auto& victim = lru_.back();
+    size_ -= victim.cost;
+    index_.erase(victim.key);
+    lru_.pop_back();
+  }
+}
@@ -0,0 +1,145 @@
+#pragma once
+
+#include <cstdint>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
+#include <utility>
+#include <sys/stat.h>
+#include <boost/asio/buffer.hpp>
+#include <boost/asio/thread_pool.hpp>
+#include <boost/beast/core/error.hpp>
+#include <boost/beast/core/string.hpp>
+#include <boost/beast/http/message.hpp>
+#include <boost/optional.hpp>
+
+namespace beast = boost::beast;         // from <boost/beast.hpp>
+namespace http = beast::http;           // from <boost/beast/http.hpp>
+namespace net = boost::asio;            // from <boost/asio.hpp>
+
+// Content codings we can send, usable as bits of a mask
+enum class content_coding : unsigned
+{
+  identity = 0,
+  gzip = 1,
+  br = 2
+};
+
+// Value of the Content-Encoding header, empty for identity
+beast::string_view
+coding_name(content_coding coding);
+
+// File name suffix of a precompressed sibling, e.g. ".gz"
+beast::string_view
+coding_suffix(content_coding coding);
+
+// Pick the best coding among the `available` mask (bits of
+// content_coding) acceptable to an Accept-Encoding header.
+content_coding
+negotiate_coding(beast::string_view accept_encoding, unsigned available);
+
+// Returns `true` if a mime type is worth compressing
+bool
+is_compressible(beast::string_view mime_type);
+
+// A strong entity tag identifying one version of a file,
+// built from its inode, modification time and size.
+// Returns an empty string if the file can't be stat'ed.
+std::string
+entity_tag(std::string const& path);
+
+// The same from the result of a stat() already made
+std::string
+entity_tag(struct stat const& st);
+
+// A response body referring to an immutable shared string,
+// so cached objects are sent without being copied.
+struct shared_string_body
+{
+  using value_type = std::shared_ptr<std::string const>;
+
+  static std::uint64_t
+    size(value_type const& body)
+  {
+    return body ? body->size() : 0;
+  }
+
+  class writer
+  {
+    value_type const& body_;
+
+  public:
+    using const_buffers_type = net::const_buffer;
+
+    template <bool isRequest, class Fields>
+    writer(http::header<isRequest, Fields> const&, value_type const& body)
+      : body_(body)
+    {
+    }
+
+    void
+      init(beast::error_code& ec)
+    {
+      ec = {};
+    }
+
+    boost::optional<std::pair<const_buffers_type, bool>>
+      get(beast::error_code& ec)
+    {
+      ec = {};
+      return std::make_pair(
+        net::const_buffer(body_ ? body_->data() : nullptr, size(body_)), false);
+    }
+  };
+};
+
+// A bounded LRU cache of compressed files keyed by entity tag and
+// coding. Misses are compressed on a private thread pool, never on
+// the io_context threads; until the object is ready the caller sends
+// the identity representation.
+class compression_cache
+{
+  struct entry
+  {
+    std::string key;
+    std::shared_ptr<std::string const> data;
+    std::size_t cost; // bytes charged against the capacity
+  };
+
+  std::size_t capacity_;
+  std::size_t max_object_;
+  std::size_t size_ = 0;
+  std::mutex mutex_;
+  std::list<entry> lru_;
+  std::unordered_map<std::string, std::list<entry>::iterator> index_;
+  std::unordered_set<std::string> pending_;
+
+  // Declared last so its threads are joined before the members they use are destroyed
+  net::thread_pool pool_;
+
+public:
+  compression_cache(std::size_t capacity, std::size_t max_object, std::size_t threads);
+
+  // Mask of the codings we can produce
+  static unsigned
+    codings();
+
+  // Returns the cached object, or nullptr after scheduling its
+  // compression if `file_size` is small enough to be cached.
+  std::shared_ptr<std::string const>
+    find_or_compress(
+      std::string const& path,
+      std::string const& etag,
+      std::uint64_t file_size,
+      content_coding coding);
+
+private:
+  void
+    compress(std::string path, std::string key, content_coding coding);
+
+  void
+    insert(std::string const& key, std::shared_ptr<std::string const> data);
+};
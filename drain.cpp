@@ -0,0 +1,92 @@
+#include <vector>
+#include "drain.hpp"
+
+void
+session_registry::add(std::shared_ptr<drainable> const& session)
+{
+  bool draining;
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    sessions_.emplace(session.get(), session);
+    draining = draining_;
+  }
+  if (draining)
+    session->drain();
+}
+
+void
+session_registry::remove(drainable* session)
+{
+  std::function<void()> on_empty;
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    sessions_.erase(session);
+    if (draining_ && sessions_.empty())
+      on_empty = std::move(on_empty_);
+  }
+  if (on_empty)
+    on_empty();
+}
+
+void
+session_registry::drain(std::function<void()> on_empty)
+{
+  std::vector<std::shared_ptr<drainable>> live;
+  bool empty;
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    draining_ = true;
+    for (auto& kv : sessions_)
+      if (auto session = kv.second.lock())
+        live.push_back(std::move(session));
+    empty = sessions_.empty();
+    if (!empty)
+      on_empty_ = std::move(on_empty);
+  }
+  if (empty)
+    return on_empty();
+
+  // Sessions are drained outside of the lock, since dropping the
+  // last reference to one of them ends up in remove()
+  for (auto& session : live)
+    session->drain();
+}
+
+std::size_t
+session_registry::size()
+{
+  std::lock_guard<std::mutex> lock(mutex_);
+  return sessions_.size();
+}
+
+std::shared_ptr<void>
+session_registry::start_job()
+{
+  std::lock_guard<std::mutex> lock(mutex_);
+  ++jobs_;
+  return std::shared_ptr<void>(nullptr,
+    [this](void*)
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      if (--jobs_ == 0)
+        jobs_done_.notify_all();
+    });
+}
+
+void
+session_registry::stop_jobs()
+{
+  std::vector<std::shared_ptr<drainable>> live;
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    for (auto& kv : sessions_)
+      if (auto session = kv.second.lock())
+        live.push_back(std::move(session));
+  }
+  for (auto& session : live)
+    session->stop_jobs();
+  live.clear();
+
+  std::unique_lock<std::mutex> lock(mutex_);
+  jobs_done_.wait(lock, [this] { return jobs_ == 0; });
+}
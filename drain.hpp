@@ -0,0 +1,64 @@
+#pragma once
+
+#include <condition_variable>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+
+// Something which can be asked to finish its current work and close.
+class drainable
+{
+public:
+  virtual ~drainable() = default;
+
+  // May be called from any thread
+  virtual void
+    drain() = 0;
+
+  // Ask the jobs running on their own thread to return, without
+  // going through the io_context. May be called from any thread.
+  virtual void
+    stop_jobs()
+  {
+  }
+};
+
+// Tracks the live sessions so a graceful shutdown can ask each of
+// them to finish its current response, and learn when they are gone.
+class session_registry
+{
+  std::mutex mutex_;
+  std::unordered_map<drainable*, std::weak_ptr<drainable>> sessions_;
+  std::function<void()> on_empty_;
+  bool draining_ = false;
+  std::condition_variable jobs_done_;
+  std::size_t jobs_ = 0;
+
+public:
+  // Register a session. If a drain is in progress it is drained at once.
+  void
+    add(std::shared_ptr<drainable> const& session);
+
+  // Called by a session when it is destroyed
+  void
+    remove(drainable* session);
+
+  // Drain every session, `on_empty` is called once the last one is gone
+  void
+    drain(std::function<void()> on_empty);
+
+  std::size_t
+    size();
+
+  // Count a job writing to a socket from its own thread,
+  // for as long as the token is held
+  std::shared_ptr<void>
+    start_job();
+
+  // Ask every session to stop its jobs, and wait until they returned.
+  // Called once the io_context threads are joined, before the sockets
+  // the jobs write to are destroyed.
+  void
+    stop_jobs();
+};
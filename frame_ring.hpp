@@ -0,0 +1,78 @@
+#pragma once
+
+// Layout of the shared memory ring through which external processes
+// (camera daemons, the shm_producer tool) hand encoded JPEG frames to
+// the server. There is a single producer; the server only pins slots
+// while it sends them, so frames are never copied into the server.
+//
+//   ring_header | slot_header[slot_count] | slot_count * slot_capacity bytes
+//
+// Producer, for frame n:
+//   1. pick a slot whose `readers` is 0
+//   2. store an odd value in its `seq`, then re-check `readers`; if the
+//      server pinned it meanwhile, restore `seq` and pick another slot
+//   3. copy the frame, store `seq` = 2 * n, then `published` = n << 8 | slot
+//
+// Server:
+//   1. load `published`, increment `readers` of the slot
+//   2. load `seq`: the frame is pinned if it equals 2 * n, otherwise it
+//      was overwritten and the slot is released
+//   3. decrement `readers` once the frame is sent
+//
+// Both sides use sequentially consistent operations on `seq` and
+// `readers`, so at least one of them sees the other's write.
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+
+namespace frame_ring
+{
+
+constexpr std::uint32_t magic = 0x4d4a5047; // "MJPG"
+constexpr std::uint32_t version = 1;
+constexpr std::uint32_t max_slots = 256;
+
+struct alignas(64) slot_header
+{
+  std::atomic<std::uint64_t> seq;
+  std::atomic<std::uint32_t> readers;
+  std::uint32_t size;
+};
+
+struct alignas(64) ring_header
+{
+  std::uint32_t magic;
+  std::uint32_t version;
+  std::uint32_t slot_count;
+  std::uint32_t slot_capacity;
+
+  // Sequence number of the last complete frame << 8 | its slot, 0 if none
+  std::atomic<std::uint64_t> published;
+};
+
+static_assert(std::atomic<std::uint64_t>::is_always_lock_free, "shared atomics must be lock-free");
+static_assert(std::atomic<std::uint32_t>::is_always_lock_free, "shared atomics must be lock-free");
+
+inline std::size_t
+mapping_size(std::uint32_t slot_count, std::uint32_t slot_capacity)
+{
+  return sizeof(ring_header) +
+    sizeof(slot_header) * slot_count +
+    std::size_t{ slot_count } * slot_capacity;
+}
+
+inline slot_header*
+slots(ring_header* ring)
+{
+  return reinterpret_cast<slot_header*>(ring + 1);
+}
+
+inline std::uint8_t*
+slot_data(ring_header* ring, std::uint32_t slot)
+{
+  return reinterpret_cast<std::uint8_t*>(slots(ring) + ring->slot_count) +
+    std::size_t{ slot } * ring->slot_capacity;
+}
+
+} // namespace frame_ring
@@ -0,0 +1,185 @@
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include "handover.hpp"
+#include "server.hpp"
+
+namespace
+{
+
+// The payload carried along with the descriptor
+constexpr char handover_tag[] = "listener";
+
+bool
+send_fd(int sock, int fd)
+{
+  char data[sizeof(handover_tag)];
+  std::memcpy(data, handover_tag, sizeof(data));
+  iovec iov{ data, sizeof(data) };
+
+  alignas(cmsghdr) char control[CMSG_SPACE(sizeof(int))] = {};
+  msghdr msg{};
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = control;
+  msg.msg_controllen = sizeof(control);
+
+  cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+  cmsg->cmsg_level = SOL_SOCKET;
+  cmsg->cmsg_type = SCM_RIGHTS;
+  cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+  std::memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+
+  return ::sendmsg(sock, &msg, MSG_NOSIGNAL) == static_cast<ssize_t>(sizeof(data));
+}
+
+int
+recv_fd(int sock)
+{
+  char data[sizeof(handover_tag)];
+  iovec iov{ data, sizeof(data) };
+
+  alignas(cmsghdr) char control[CMSG_SPACE(sizeof(int))] = {};
+  msghdr msg{};
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = control;
+  msg.msg_controllen = sizeof(control);
+
+  if (::recvmsg(sock, &msg, MSG_CMSG_CLOEXEC) != static_cast<ssize_t>(sizeof(data)) ||
+    std::memcmp(data, handover_tag, sizeof(data)) != 0)
+    return -1;
+
+  cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+  if (!cmsg ||
+    cmsg->cmsg_level != SOL_SOCKET ||
+    cmsg->cmsg_type != SCM_RIGHTS ||
+    cmsg->cmsg_len != CMSG_LEN(sizeof(int)))
+    return -1;
+
+  int fd;
+  std::memcpy(&fd, CMSG_DATA(cmsg), sizeof(int));
+  return fd;
+}
+
+} // namespace
+
+int
+request_listener(std::string const& path)
+{
+  sockaddr_un addr{};
+  if (path.size() >= sizeof(addr.sun_path))
+    return -1;
+  addr.sun_family = AF_UNIX;
+  std::memcpy(addr.sun_path, path.c_str(), path.size() + 1);
+
+  int const sock = ::socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (sock < 0)
+    return -1;
+
+  // Don't hang on a process which accepted but never answers
+  timeval timeout{ 5, 0 };
+  ::setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+
+  int fd = -1;
+  if (::connect(sock, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) == 0)
+    fd = recv_fd(sock);
+  ::close(sock);
+
+  if (fd >= 0)
+    spdlog::info("Took over the listening socket from {}", path);
+  return fd;
+}
+
+void
+spawn_successor(char* argv[])
+{
+  // Computed before forking, only async-signal-safe calls are made in the child
+  long const max_fd = ::sysconf(_SC_OPEN_MAX);
+
+  pid_t const pid = ::fork();
+  if (pid == 0)
+  {
+    // Keep only stdin, stdout and stderr: the listening socket is taken
+    // over through the handover socket, and the descriptors of asio
+    // (connections, epoll, eventfd) must not leak into the successor
+#ifdef SYS_close_range
+    if (::syscall(SYS_close_range, 3u, ~0u, 0u) != 0)
+#endif
+      for (long fd = 3; fd < (max_fd > 0 ? max_fd : 65536); ++fd)
+        ::close(static_cast<int>(fd));
+
+    // The binary of this process, wherever it was started from
+    ::execv("/proc/self/exe", argv);
+    std::_Exit(127);
+  }
+  if (pid < 0)
+    spdlog::debug("fork failed: {}", std::strerror(errno));
+  else
+    spdlog::info("Started process {} to take over", pid);
+}
+
+//------------------------------------------------------------------------------
+
+handover_server::handover_server(
+  net::io_context& ioc,
+  std::string const& path,
+  int listen_fd,
+  std::function<void()> on_handover)
+  : acceptor_(ioc), listen_fd_(listen_fd), on_handover_(std::move(on_handover))
+{
+  beast::error_code ec;
+  net::local::stream_protocol::endpoint const endpoint(path);
+
+  // A previous process may have left its socket file behind
+  ::unlink(path.c_str());
+
+  acceptor_.open(endpoint.protocol(), ec);
+  if (!ec)
+    acceptor_.bind(endpoint, ec);
+  if (!ec)
+    acceptor_.listen(net::socket_base::max_listen_connections, ec);
+  if (ec)
+    fail(ec, "handover");
+}
+
+void
+handover_server::run()
+{
+  if (acceptor_.is_open())
+    do_accept();
+}
+
+void
+handover_server::do_accept()
+{
+  acceptor_.async_accept(
+    [self = shared_from_this()](beast::error_code ec, net::local::stream_protocol::socket socket)
+    {
+      self->on_accept(ec, std::move(socket));
+    });
+}
+
+void
+handover_server::on_accept(beast::error_code ec, net::local::stream_protocol::socket socket)
+{
+  if (ec == net::error::operation_aborted)
+    return;
+
+  if (ec || !send_fd(socket.native_handle(), listen_fd_))
+  {
+    spdlog::debug("Listening socket handover failed: {}", ec ? ec.message() : std::strerror(errno));
+    return do_accept();
+  }
+
+  spdlog::info("Listening socket handed over to a new process");
+
+  // Only one process may take over
+  acceptor_.close(ec);
+  on_handover_();
+}
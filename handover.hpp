@@ -0,0 +1,51 @@
+#pragma once
+
+#include <functional>
+#include <memory>
+#include <string>
+#include <boost/asio/io_context.hpp>
+#include <boost/asio/local/stream_protocol.hpp>
+#include <boost/beast/core/error.hpp>
+
+namespace beast = boost::beast;         // from <boost/beast.hpp>
+namespace net = boost::asio;            // from <boost/asio.hpp>
+
+// Ask the server process listening on the Unix socket `path` for its
+// listening TCP socket. Returns the received descriptor, or -1 when
+// no process answered, in which case the caller binds a fresh socket.
+int
+request_listener(std::string const& path);
+
+// Start a new server process with the same arguments. With the
+// same --handover option it takes the listening socket over.
+void
+spawn_successor(char* argv[]);
+
+// Waits on a Unix socket for a newly started server process and
+// passes it the listening TCP socket with SCM_RIGHTS. Since both
+// processes then share the same socket, connections queued in the
+// backlog are never refused while the old process drains.
+class handover_server : public std::enable_shared_from_this<handover_server>
+{
+  net::local::stream_protocol::acceptor acceptor_;
+  int listen_fd_;
+  std::function<void()> on_handover_;
+
+public:
+  handover_server(
+    net::io_context& ioc,
+    std::string const& path,
+    int listen_fd,
+    std::function<void()> on_handover);
+
+  // Start waiting for the next process
+  void
+    run();
+
+private:
+  void
+    do_accept();
+
+  void
+    on_accept(beast::error_code ec, net::local::stream_protocol::socket socket);
+};
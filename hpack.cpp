@@ -0,0 +1,557 @@
+#include <algorithm>
+#include <array>
+#include "hpack.hpp"
+
+namespace hpack
+{
+
+namespace
+{
+
+// RFC 7541 appendix A
+struct static_entry
+{
+  std::string_view name;
+  std::string_view value;
+};
+
+constexpr static_entry static_table[] = {
+  { ":authority", "" },
+  { ":method", "GET" },
+  { ":method", "POST" },
+  { ":path", "/" },
+  { ":path", "/index.html" },
+  { ":scheme", "http" },
+  { ":scheme", "https" },
+  { ":status", "200" },
+  { ":status", "204" },
+  { ":status", "206" },
+  { ":status", "304" },
+  { ":status", "400" },
+  { ":status", "404" },
+  { ":status", "500" },
+  { "accept-charset", "" },
+  { "accept-encoding", "gzip, deflate" },
+  { "accept-language", "" },
+  { "accept-ranges", "" },
+  { "accept", "" },
+  { "access-control-allow-origin", "" },
+  { "age", "" },
+  { "allow", "" },
+  { "authorization", "" },
+  { "cache-control", "" },
+  { "content-disposition", "" },
+  { "content-encoding", "" },
+  { "content-language", "" },
+  { "content-length", "" },
+  { "content-location", "" },
+  { "content-range", "" },
+  { "content-type", "" },
+  { "cookie", "" },
+  { "date", "" },
+  { "etag", "" },
+  { "expect", "" },
+  { "expires", "" },
+  { "from", "" },
+  { "host", "" },
+  { "if-match", "" },
+  { "if-modified-since", "" },
+  { "if-none-match", "" },
+  { "if-range", "" },
+  { "if-unmodified-since", "" },
+  { "last-modified", "" },
+  { "link", "" },
+  { "location", "" },
+  { "max-forwards", "" },
+  { "proxy-authenticate", "" },
+  { "proxy-authorization", "" },
+  { "range", "" },
+  { "referer", "" },
+  { "refresh", "" },
+  { "retry-after", "" },
+  { "server", "" },
+  { "set-cookie", "" },
+  { "strict-transport-security", "" },
+  { "transfer-encoding", "" },
+  { "user-agent", "" },
+  { "vary", "" },
+  { "via", "" },
+  { "www-authenticate", "" },
+};
+
+constexpr std::size_t static_size = sizeof(static_table) / sizeof(static_table[0]);
+
+// RFC 7541 section 4.1: every entry costs 32 bytes on top of its strings
+constexpr std::size_t entry_overhead = 32;
+
+// Larger header lists are refused
+constexpr std::size_t max_header_list = 64 * 1024;
+
+// RFC 7541 appendix B: code (right-aligned) and length in bits, by symbol
+struct huffman_code
+{
+  std::uint32_t code;
+  std::uint8_t bits;
+};
+
+constexpr huffman_code huffman_table[257] = {
+  { 0x1ff8, 13 }, { 0x7fffd8, 23 }, { 0xfffffe2, 28 }, { 0xfffffe3, 28 },
+  { 0xfffffe4, 28 }, { 0xfffffe5, 28 }, { 0xfffffe6, 28 }, { 0xfffffe7, 28 },
+  { 0xfffffe8, 28 }, { 0xffffea, 24 }, { 0x3ffffffc, 30 }, { 0xfffffe9, 28 },
+  { 0xfffffea, 28 }, { 0x3ffffffd, 30 }, { 0xfffffeb, 28 }, { 0xfffffec, 28 },
+  { 0xfffffed, 28 }, { 0xfffffee, 28 }, { 0xfffffef, 28 }, { 0xffffff0, 28 },
+  { 0xffffff1, 28 }, { 0xffffff2, 28 }, { 0x3ffffffe, 30 }, { 0xffffff3, 28 },
+  { 0xffffff4, 28 }, { 0xffffff5, 28 }, { 0xffffff6, 28 }, { 0xffffff7, 28 },
+  { 0xffffff8, 28 }, { 0xffffff9, 28 }, { 0xffffffa, 28 }, { 0xffffffb, 28 },
+  { 0x14, 6 }, { 0x3f8, 10 }, { 0x3f9, 10 }, { 0xffa, 12 },
+  { 0x1ff9, 13 }, { 0x15, 6 }, { 0xf8, 8 }, { 0x7fa, 11 },
+  { 0x3fa, 10 }, { 0x3fb, 10 }, { 0xf9, 8 }, { 0x7fb, 11 },
+  { 0xfa, 8 }, { 0x16, 6 }, { 0x17, 6 }, { 0x18, 6 },
+  { 0x0, 5 }, { 0x1, 5 }, { 0x2, 5 }, { 0x19, 6 },
+  { 0x1a, 6 }, { 0x1b, 6 }, { 0x1c, 6 }, { 0x1d, 6 },
+  { 0x1e, 6 }, { 0x1f, 6 }, { 0x5c, 7 }, { 0xfb, 8 },
+  { 0x7ffc, 15 }, { 0x20, 6 }, { 0xffb, 12 }, { 0x3fc, 10 },
+  { 0x1ffa, 13 }, { 0x21, 6 }, { 0x5d, 7 }, { 0x5e, 7 },
+  { 0x5f, 7 }, { 0x60, 7 }, { 0x61, 7 }, { 0x62, 7 },
+  { 0x63, 7 }, { 0x64, 7 }, { 0x65, 7 }, { 0x66, 7 },
+  { 0x67, 7 }, { 0x68, 7 }, { 0x69, 7 }, { 0x6a, 7 },
+  { 0x6b, 7 }, { 0x6c, 7 }, { 0x6d, 7 }, { 0x6e, 7 },
+  { 0x6f, 7 }, { 0x70, 7 }, { 0x71, 7 }, { 0x72, 7 },
+  { 0xfc, 8 }, { 0x73, 7 }, { 0xfd, 8 }, { 0x1ffb, 13 },
+  { 0x7fff0, 19 }, { 0x1ffc, 13 }, { 0x3ffc, 14 }, { 0x22, 6 },
+  { 0x7ffd, 15 }, { 0x3, 5 }, { 0x23, 6 }, { 0x4, 5 },
+  { 0x24, 6 }, { 0x5, 5 }, { 0x25, 6 }, { 0x26, 6 },
+  { 0x27, 6 }, { 0x6, 5 }, { 0x74, 7 }, { 0x75, 7 },
+  { 0x28, 6 }, { 0x29, 6 }, { 0x2a, 6 }, { 0x7, 5 },
+  { 0x2b, 6 }, { 0x76, 7 }, { 0x2c, 6 }, { 0x8, 5 },
+  { 0x9, 5 }, { 0x2d, 6 }, { 0x77, 7 }, { 0x78, 7 },
+  { 0x79, 7 }, { 0x7a, 7 }, { 0x7b, 7 }, { 0x7ffe, 15 },
+  { 0x7fc, 11 }, { 0x3ffd, 14 }, { 0x1ffd, 13 }, { 0xffffffc, 28 },
+  { 0xfffe6, 20 }, { 0x3fffd2, 22 }, { 0xfffe7, 20 }, { 0xfffe8, 20 },
+  { 0x3fffd3, 22 }, { 0x3fffd4, 22 }, { 0x3fffd5, 22 }, { 0x7fffd9, 23 },
+  { 0x3fffd6, 22 }, { 0x7fffda, 23 }, { 0x7fffdb, 23 }, { 0x7fffdc, 23 },
+  { 0x7fffdd, 23 }, { 0x7fffde, 23 }, { 0xffffeb, 24 }, { 0x7fffdf, 23 },
+  { 0xffffec, 24 }, { 0xffffed, 24 }, { 0x3fffd7, 22 }, { 0x7fffe0, 23 },
+  { 0xffffee, 24 }, { 0x7fffe1, 23 }, { 0x7fffe2, 23 }, { 0x7fffe3, 23 },
+  { 0x7fffe4, 23 }, { 0x1fffdc, 21 }, { 0x3fffd8, 22 }, { 0x7fffe5, 23 },
+  { 0x3fffd9, 22 }, { 0x7fffe6, 23 }, { 0x7fffe7, 23 }, { 0xffffef, 24 },
+  { 0x3fffda, 22 }, { 0x1fffdd, 21 }, { 0xfffe9, 20 }, { 0x3fffdb, 22 },
+  { 0x3fffdc, 22 }, { 0x7fffe8, 23 }, { 0x7fffe9, 23 }, { 0x1fffde, 21 },
+  { 0x7fffea, 23 }, { 0x3fffdd, 22 }, { 0x3fffde, 22 }, { 0xfffff0, 24 },
+  { 0x1fffdf, 21 }, { 0x3fffdf, 22 }, { 0x7fffeb, 23 }, { 0x7fffec, 23 },
+  { 0x1fffe0, 21 }, { 0x1fffe1, 21 }, { 0x3fffe0, 22 }, { 0x1fffe2, 21 },
+  { 0x7fffed, 23 }, { 0x3fffe1, 22 }, { 0x7fffee, 23 }, { 0x7fffef, 23 },
+  { 0xfffea, 20 }, { 0x3fffe2, 22 }, { 0x3fffe3, 22 }, { 0x3fffe4, 22 },
+  { 0x7ffff0, 23 }, { 0x3fffe5, 22 }, { 0x3fffe6, 22 }, { 0x7ffff1, 23 },
+  { 0x3ffffe0, 26 }, { 0x3ffffe1, 26 }, { 0xfffeb, 20 }, { 0x7fff1, 19 },
+  { 0x3fffe7, 22 }, { 0x7ffff2, 23 }, { 0x3fffe8, 22 }, { 0x1ffffec, 25 },
+  { 0x3ffffe2, 26 }, { 0x3ffffe3, 26 }, { 0x3ffffe4, 26 }, { 0x7ffffde, 27 },
+  { 0x7ffffdf, 27 }, { 0x3ffffe5, 26 }, { 0xfffff1, 24 }, { 0x1ffffed, 25 },
+  { 0x7fff2, 19 }, { 0x1fffe3, 21 }, { 0x3ffffe6, 26 }, { 0x7ffffe0, 27 },
+  { 0x7ffffe1, 27 }, { 0x3ffffe7, 26 }, { 0x7ffffe2, 27 }, { 0xfffff2, 24 },
+  { 0x1fffe4, 21 }, { 0x1fffe5, 21 }, { 0x3ffffe8, 26 }, { 0x3ffffe9, 26 },
+  { 0xffffffd, 28 }, { 0x7ffffe3, 27 }, { 0x7ffffe4, 27 }, { 0x7ffffe5, 27 },
+  { 0xfffec, 20 }, { 0xfffff3, 24 }, { 0xfffed, 20 }, { 0x1fffe6, 21 },
+  { 0x3fffe9, 22 }, { 0x1fffe7, 21 }, { 0x1fffe8, 21 }, { 0x7ffff3, 23 },
+  { 0x3fffea, 22 }, { 0x3fffeb, 22 }, { 0x1ffffee, 25 }, { 0x1ffffef, 25 },
+  { 0xfffff4, 24 }, { 0xfffff5, 24 }, { 0x3ffffea, 26 }, { 0x7ffff4, 23 },
+  { 0x3ffffeb, 26 }, { 0x7ffffe6, 27 }, { 0x3ffffec, 26 }, { 0x3ffffed, 26 },
+  { 0x7ffffe7, 27 }, { 0x7ffffe8, 27 }, { 0x7ffffe9, 27 }, { 0x7ffffea, 27 },
+  { 0x7ffffeb, 27 }, { 0xffffffe, 28 }, { 0x7ffffec, 27 }, { 0x7ffffed, 27 },
+  { 0x7ffffee, 27 }, { 0x7ffffef, 27 }, { 0x7fffff0, 27 }, { 0x3ffffee, 26 },
+  { 0x3fffffff, 30 },
+};
+
+constexpr unsigned eos = 256;
+
+// Binary tree of the code: node 0 is the root, a child is a node
+// index or ~symbol for a leaf, 0 when absent
+struct huffman_tree
+{
+  std::vector<std::array<std::int32_t, 2>> nodes{ 1 };
+
+  huffman_tree()
+  {
+    for (unsigned sym = 0; sym < 257; ++sym)
+    {
+      auto const& c = huffman_table[sym];
+      std::size_t node = 0;
+      for (int bit = c.bits - 1; bit >= 0; --bit)
+      {
+        auto const b = (c.code >> bit) & 1;
+        if (bit == 0)
+        {
+          nodes[node][b] = ~static_cast<std::int32_t>(sym);
+          break;
+        }
+        if (nodes[node][b] == 0)
+        {
+          nodes[node][b] = static_cast<std::int32_t>(nodes.size());
+          nodes.push_back({ 0, 0 });
+        }
+        node = static_cast<std::size_t>(nodes[node][b]);
+      }
+    }
+  }
+};
+
+// Read an integer with an N-bit prefix (RFC 7541 section 5.1)
+bool
+read_integer(std::uint8_t const*& p, std::uint8_t const* end, int prefix, std::size_t& value)
+{
+  if (p == end)
+    return false;
+  std::size_t const mask = (1u << prefix) - 1;
+  value = *p++ & mask;
+  if (value < mask)
+    return true;
+  for (int shift = 0; shift <= 28; shift += 7)
+  {
+    if (p == end)
+      return false;
+    auto const b = *p++;
+    value += std::size_t{ b & 0x7fu } << shift;
+    if (!(b & 0x80))
+      return true;
+  }
+  return false;
+}
+
+bool
+read_string(std::uint8_t const*& p, std::uint8_t const* end, std::string& out)
+{
+  if (p == end)
+    return false;
+  bool const huffman = *p & 0x80;
+  std::size_t length = 0;
+  if (!read_integer(p, end, 7, length) || length > static_cast<std::size_t>(end - p))
+    return false;
+  out.clear();
+  if (huffman)
+  {
+    if (!huffman_decode(p, length, out))
+      return false;
+  }
+  else
+  {
+    out.assign(reinterpret_cast<char const*>(p), length);
+  }
+  p += length;
+  return true;
+}
+
+void
+write_integer(std::string& out, std::uint8_t first, int prefix, std::size_t value)
+{
+  std::size_t const mask = (1u << prefix) - 1;
+  if (value < mask)
+  {
+    out.push_back(static_cast<char>(first | value));
+    return;
+  }
+  out.push_back(static_cast<char>(first | mask));
+  value -= mask;
+  while (value >= 0x80)
+  {
+    out.push_back(static_cast<char>(0x80 | (value & 0x7f)));
+    value >>= 7;
+  }
+  out.push_back(static_cast<char>(value));
+}
+
+void
+write_string(std::string& out, std::string_view s)
+{
+  auto const huffman = huffman_size(s);
+  if (huffman < s.size())
+  {
+    write_integer(out, 0x80, 7, huffman);
+    huffman_encode(s, out);
+  }
+  else
+  {
+    write_integer(out, 0, 7, s.size());
+    out.append(s.data(), s.size());
+  }
+}
+
+// Values which change with every response aren't worth a table entry
+bool
+is_volatile(std::string_view name)
+{
+  return name == "content-length" ||
+    name == "content-range" ||
+    name == "etag" ||
+    name == "date" ||
+    name == "last-modified" ||
+    name == "set-cookie";
+}
+
+} // namespace
+
+//------------------------------------------------------------------------------
+
+void
+header_table::resize(std::size_t max_size)
+{
+  max_size_ = max_size;
+  while (size_ > max_size_)
+  {
+    auto const& e = entries_.back();
+    size_ -= e.name.size() + e.value.size() + entry_overhead;
+    entries_.pop_back();
+  }
+}
+
+void
+header_table::insert(std::string name, std::string value)
+{
+  auto const size = name.size() + value.size() + entry_overhead;
+
+  // An entry larger than the table empties it (RFC 7541 section 4.4)
+  if (size > max_size_)
+  {
+    entries_.clear();
+    size_ = 0;
+    return;
+  }
+  while (size_ + size > max_size_)
+  {
+    auto const& e = entries_.back();
+    size_ -= e.name.size() + e.value.size() + entry_overhead;
+    entries_.pop_back();
+  }
+  entries_.push_front(header_field{ std::move(name), std::move(value) });
+  size_ += size;
+}
+
+header_field const*
+header_table::at(std::size_t index) const
+{
+  if (index == 0)
+    return nullptr;
+  if (index <= static_size)
+  {
+    // Static entries are materialized once
+    static std::vector<header_field> const fields = []
+      {
+        std::vector<header_field> v;
+        for (auto const& e : static_table)
+          v.push_back(header_field{ std::string(e.name), std::string(e.value) });
+        return v;
+      }();
+    return &fields[index - 1];
+  }
+  index -= static_size + 1;
+  return index < entries_.size() ? &entries_[index] : nullptr;
+}
+
+std::size_t
+header_table::find(std::string_view name, std::string_view value, bool& exact) const
+{
+  std::size_t name_match = 0;
+  exact = false;
+  for (std::size_t i = 0; i < static_size; ++i)
+  {
+    if (static_table[i].name != name)
+      continue;
+    if (static_table[i].value == value)
+    {
+      exact = true;
+      return i + 1;
+    }
+    if (!name_match)
+      name_match = i + 1;
+  }
+  for (std::size_t i = 0; i < entries_.size(); ++i)
+  {
+    if (entries_[i].name != name)
+      continue;
+    if (entries_[i].value == value)
+    {
+      exact = true;
+      return static_size + 1 + i;
+    }
+    if (!name_match)
+      name_match = static_size + 1 + i;
+  }
+  return name_match;
+}
+
+//------------------------------------------------------------------------------
+
+bool
+decoder::decode(std::uint8_t const* data, std::size_t size, std::vector<header_field>& fields)
+{
+  auto const* p = data;
+  auto const* const end = data + size;
+  std::size_t list_size = 0;
+
+  while (p != end)
+  {
+    auto const b = *p;
+    std::size_t index = 0;
+    header_field field;
+
+    if (b & 0x80)
+    {
+      // Indexed field
+      if (!read_integer(p, end, 7, index))
+        return false;
+      auto const* e = table_.at(index);
+      if (!e)
+        return false;
+      field = *e;
+    }
+    else if ((b & 0xe0) == 0x20)
+    {
+      // Dynamic table size update, only before the first field
+      if (!fields.empty() || !read_integer(p, end, 5, index) || index > max_table_size_)
+        return false;
+      table_.resize(index);
+      continue;
+    }
+    else
+    {
+      // Literal, with incremental indexing (01), without (0000) or never indexed (0001)
+      bool const indexing = (b & 0xc0) == 0x40;
+      if (!read_integer(p, end, indexing ? 6 : 4, index))
+        return false;
+      if (index)
+      {
+        auto const* e = table_.at(index);
+        if (!e)
+          return false;
+        field.name = e->name;
+      }
+      else if (!read_string(p, end, field.name))
+        return false;
+      if (!read_string(p, end, field.value))
+        return false;
+      if (indexing)
+        table_.insert(field.name, field.value);
+    }
+
+    list_size += field.name.size() + field.value.size() + entry_overhead;
+    if (list_size > max_header_list)
+      return false;
+    fields.push_back(std::move(field));
+  }
+  return true;
+}
+
+//------------------------------------------------------------------------------
+
+void
+encoder::set_max_table_size(std::size_t size)
+{
+  size = std::min<std::size_t>(size, 4096);
+  if (size != table_.max_size())
+  {
+    table_.resize(size);
+    resized_ = true;
+  }
+}
+
+std::string
+encoder::encode(std::vector<header_field> const& fields)
+{
+  std::string out;
+  if (resized_)
+  {
+    write_integer(out, 0x20, 5, table_.max_size());
+    resized_ = false;
+  }
+
+  for (auto const& f : fields)
+  {
+    bool exact = false;
+    auto const index = table_.find(f.name, f.value, exact);
+    if (exact)
+    {
+      write_integer(out, 0x80, 7, index);
+      continue;
+    }
+
+    bool const indexing = !is_volatile(f.name);
+    write_integer(out, indexing ? 0x40 : 0x00, indexing ? 6 : 4, index);
+    if (!index)
+      write_string(out, f.name);
+    write_string(out, f.value);
+    if (indexing)
+      table_.insert(f.name, f.value);
+  }
+  return out;
+}
+
+//------------------------------------------------------------------------------
+
+bool
+huffman_decode(std::uint8_t const* data, std::size_t size, std::string& out)
+{
+  static huffman_tree const tree;
+
+  std::size_t node = 0;
+  int depth = 0;       // bits read since the last symbol
+  bool ones = true;    // and they are all ones
+  for (std::size_t i = 0; i < size; ++i)
+  {
+    for (int bit = 7; bit >= 0; --bit)
+    {
+      auto const b = (data[i] >> bit) & 1;
+      auto const next = tree.nodes[node][b];
+      if (next == 0)
+        return false;
+      if (next < 0)
+      {
+        auto const sym = static_cast<unsigned>(~next);
+        if (sym == eos)
+          return false;
+        out.push_back(static_cast<char>(sym));
+        node = 0;
+        depth = 0;
+        ones = true;
+        continue;
+      }
+      node = static_cast<std::size_t>(next);
+      ++depth;
+      ones = ones && b;
+    }
+  }
+
+  // The padding is a prefix of EOS shorter than a byte (RFC 7541 section 5.2)
+  return depth < 8 && ones;
+}
+
+std::size_t
+huffman_size(std::string_view in)
+{
+  std::size_t bits = 0;
+  for (unsigned char c : in)
+    bits += huffman_table[c].bits;
+  return (bits + 7) / 8;
+}
+
+void
+huffman_encode(std::string_view in, std::string& out)
+{
+  std::uint64_t acc = 0;
+  int bits = 0;
+  for (unsigned char c : in)
+  {
+    auto const& code = huffman_table[c];
+    acc = (acc << code.bits) | code.code;
+    bits += code.bits;
+    while (bits >= 8)
+    {
+      bits -= 8;
+      out.push_back(static_cast<char>(acc >> bits));
+    }
+  }
+
+  // Pad with the most significant bits of EOS
+  if (bits > 0)
+    out.push_back(static_cast<char>((acc << (8 - bits)) | (0xff >> bits)));
+}
+
+} // namespace hpack
@@ -0,0 +1,103 @@
+#pragma once
+
+// HPACK, the header compression of HTTP/2 (RFC 7541)
+
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <string>
+#include <string_view>
+#include <vector>
+
+namespace hpack
+{
+
+struct header_field
+{
+  std::string name;
+  std::string value;
+};
+
+// The static table followed by the entries added by header blocks,
+// newest first, as addressed by the indexes of RFC 7541 section 2.3.3
+class header_table
+{
+  std::deque<header_field> entries_;
+  std::size_t size_ = 0;
+  std::size_t max_size_;
+
+public:
+  explicit header_table(std::size_t max_size = 4096)
+    : max_size_(max_size)
+  {
+  }
+
+  std::size_t
+    max_size() const
+  {
+    return max_size_;
+  }
+
+  // Evicts entries until the table fits
+  void
+    resize(std::size_t max_size);
+
+  void
+    insert(std::string name, std::string value);
+
+  // Returns nullptr if the index is out of range
+  header_field const*
+    at(std::size_t index) const;
+
+  // Returns the index of the field, or of its name only when `exact`
+  // is set to false, 0 if the name isn't in the table at all
+  std::size_t
+    find(std::string_view name, std::string_view value, bool& exact) const;
+};
+
+// Decodes the header blocks of one connection
+class decoder
+{
+  header_table table_;
+  std::size_t max_table_size_;
+
+public:
+  // `max_table_size` is our SETTINGS_HEADER_TABLE_SIZE
+  explicit decoder(std::size_t max_table_size = 4096)
+    : table_(max_table_size)
+    , max_table_size_(max_table_size)
+  {
+  }
+
+  // Decode a complete header block, returns `false` on a compression
+  // error, which is fatal for the connection
+  bool
+    decode(std::uint8_t const* data, std::size_t size, std::vector<header_field>& fields);
+};
+
+// Encodes the header blocks of one connection. Field names must be lowercase.
+class encoder
+{
+  header_table table_;
+  bool resized_ = false;
+
+public:
+  // Apply the peer's SETTINGS_HEADER_TABLE_SIZE, we use at most 4096 bytes
+  void
+    set_max_table_size(std::size_t size);
+
+  std::string
+    encode(std::vector<header_field> const& fields);
+};
+
+// Huffman code of string literals, returns `false` on invalid input
+bool
+huffman_decode(std::uint8_t const* data, std::size_t size, std::string& out);
+
+void
+huffman_encode(std::string_view in, std::string& out);
+
+std::size_t
+huffman_size(std::string_view in);
+
+} // namespace hpack
@@ -0,0 +1,77 @@
+#pragma once
+
+// The framing layer of HTTP/2 (RFC 9113 section 4)
+//
+//   length (24) | type (8) | flags (8) | R (1) | stream id (31) | payload
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+namespace http2
+{
+
+constexpr std::size_t frame_header_size = 9;
+
+struct frame_header
+{
+  std::size_t length;
+  std::uint8_t type;
+  std::uint8_t flags;
+  std::uint32_t stream_id; // without the reserved bit
+};
+
+enum class parse_result
+{
+  complete,   // the header and the whole payload are there
+  incomplete, // more bytes are needed
+  too_large   // the payload is longer than allowed, a connection error
+};
+
+// Parse the frame at the front of `data`, whose payload may not be
+// longer than `max_length` (our SETTINGS_MAX_FRAME_SIZE). The header
+// is set unless the result is `incomplete`.
+inline parse_result
+parse_frame(std::uint8_t const* data, std::size_t size, std::size_t max_length, frame_header& header)
+{
+  if (size < frame_header_size)
+    return parse_result::incomplete;
+  header.length = std::size_t{ data[0] } << 16 | std::size_t{ data[1] } << 8 | data[2];
+  header.type = data[3];
+  header.flags = data[4];
+  header.stream_id = (std::uint32_t{ data[5] } << 24 | std::uint32_t{ data[6] } << 16 |
+    std::uint32_t{ data[7] } << 8 | data[8]) & 0x7fffffff;
+  if (header.length > max_length)
+    return parse_result::too_large;
+  if (size < frame_header_size + header.length)
+    return parse_result::incomplete;
+  return parse_result::complete;
+}
+
+inline std::string
+serialize_frame_header(std::uint8_t type, std::uint8_t flags, std::uint32_t id, std::size_t length)
+{
+  std::string h(frame_header_size, '\0');
+  h[0] = static_cast<char>(length >> 16);
+  h[1] = static_cast<char>(length >> 8);
+  h[2] = static_cast<char>(length);
+  h[3] = static_cast<char>(type);
+  h[4] = static_cast<char>(flags);
+  for (int i = 0; i < 4; ++i)
+    h[5 + i] = static_cast<char>(id >> (24 - 8 * i));
+  return h;
+}
+
+// Remove the padding of a DATA or HEADERS frame with the PADDED flag,
+// returns `false` if the padding is longer than the payload
+inline bool
+strip_padding(std::uint8_t const*& p, std::size_t& length)
+{
+  if (length < 1 || p[0] >= length)
+    return false;
+  length -= 1 + p[0];
+  ++p;
+  return true;
+}
+
+} // namespace http2
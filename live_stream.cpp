@@ -0,0 +1,842 @@
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <csetjmp>
+#include <cstring>
+#include <stdexcept>
+#include <vector>
+#include <fcntl.h>
+#include <linux/sockios.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <jpeglib.h>
+#include <boost/asio/post.hpp>
+#include <spdlog/spdlog.h>
+#include "live_stream.hpp"
+
+namespace
+{
+
+std::uint64_t
+rotl(std::uint64_t x, int r)
+{
+  return (x << r) | (x >> (64 - r));
+}
+
+// Returns an empty vector on failure
+std::vector<std::uint8_t>
+encode_jpeg(std::uint8_t const* rgb, int width, int height, int quality)
+{
+  jpeg_compress_struct cinfo;
+  jpeg_error_mgr jerr;
+  cinfo.err = jpeg_std_error(&jerr);
+  jpeg_create_compress(&cinfo);
+
+  unsigned char* out = nullptr;
+  unsigned long size = 0;
+  jpeg_mem_dest(&cinfo, &out, &size);
+  cinfo.image_width = width;
+  cinfo.image_height = height;
+  cinfo.input_components = 3;
+  cinfo.in_color_space = JCS_RGB;
+  jpeg_set_defaults(&cinfo);
+  jpeg_set_quality(&cinfo, quality, TRUE);
+  cinfo.dct_method = JDCT_IFAST;
+  jpeg_start_compress(&cinfo, TRUE);
+  while (cinfo.next_scanline < cinfo.image_height)
+  {
+    auto row = const_cast<JSAMPROW>(rgb + static_cast<std::size_t>(cinfo.next_scanline) * width * 3);
+    jpeg_write_scanlines(&cinfo, &row, 1);
+  }
+  jpeg_finish_compress(&cinfo);
+  jpeg_destroy_compress(&cinfo);
+
+  std::vector<std::uint8_t> jpeg(out, out + size);
+  std::free(out);
+  return jpeg;
+}
+
+// Average `scale` x `scale` blocks of pixels
+std::vector<std::uint8_t>
+downscale(std::uint8_t const* rgb, int width, int height, int scale)
+{
+  int const w = width / scale, h = height / scale;
+  std::vector<std::uint8_t> out(static_cast<std::size_t>(w) * h * 3);
+  for (int y = 0; y < h; ++y)
+  {
+    for (int x = 0; x < w; ++x)
+    {
+      unsigned sum[3] = {};
+      for (int dy = 0; dy < scale; ++dy)
+      {
+        auto const* p = rgb + ((static_cast<std::size_t>(y) * scale + dy) * width + x * scale) * 3;
+        for (int dx = 0; dx < scale * 3; dx += 3)
+        {
+          sum[0] += p[dx];
+          sum[1] += p[dx + 1];
+          sum[2] += p[dx + 2];
+        }
+      }
+      auto* q = &out[(static_cast<std::size_t>(y) * w + x) * 3];
+      for (int c = 0; c < 3; ++c)
+        q[c] = static_cast<std::uint8_t>(sum[c] / (scale * scale));
+    }
+  }
+  return out;
+}
+
+// Read the size of the screen from the caps GStreamer negotiates
+// for a single frame
+bool
+probe_screen_size(int& width, int& height)
+{
+  FILE* pipe = popen("gst-launch-1.0 -v ximagesrc num-buffers=1 ! fakesink 2>/dev/null", "r");
+  if (!pipe)
+    return false;
+  std::string out;
+  char buf[4096];
+  for (std::size_t n; (n = std::fread(buf, 1, sizeof(buf), pipe)) > 0;)
+    out.append(buf, n);
+  pclose(pipe);
+
+  auto const w = out.find("width=(int)");
+  auto const h = out.find("height=(int)");
+  if (w == std::string::npos || h == std::string::npos)
+    return false;
+  width = std::atoi(out.c_str() + w + 11);
+  height = std::atoi(out.c_str() + h + 12);
+  return width > 0 && height > 0;
+}
+
+// libjpeg calls exit() on errors unless told otherwise
+struct jpeg_error_jump
+{
+  jpeg_error_mgr mgr;
+  std::jmp_buf jump;
+};
+
+// Decode a JPEG reduced by `scale` in the DCT, which is cheaper than
+// decoding it fully. The outputs are references so that they stay
+// valid after a longjmp.
+bool
+decode_jpeg(std::uint8_t const* data, std::size_t size, int scale,
+  std::vector<std::uint8_t>& rgb, int& width, int& height)
+{
+  jpeg_decompress_struct cinfo;
+  jpeg_error_jump jerr;
+  cinfo.err = jpeg_std_error(&jerr.mgr);
+  jerr.mgr.error_exit = [](j_common_ptr cinfo)
+    {
+      std::longjmp(reinterpret_cast<jpeg_error_jump*>(cinfo->err)->jump, 1);
+    };
+  jerr.mgr.output_message = [](j_common_ptr) {};
+
+  if (setjmp(jerr.jump))
+  {
+    jpeg_destroy_decompress(&cinfo);
+    return false;
+  }
+  jpeg_create_decompress(&cinfo);
+  jpeg_mem_src(&cinfo, const_cast<unsigned char*>(data), static_cast<unsigned long>(size));
+  jpeg_read_header(&cinfo, TRUE);
+
+  // Don't trust the producer with the size of our buffers
+  if (cinfo.image_width > 8192 || cinfo.image_height > 8192)
+  {
+    jpeg_destroy_decompress(&cinfo);
+    return false;
+  }
+  cinfo.out_color_space = JCS_RGB;
+  cinfo.scale_num = 1;
+  cinfo.scale_denom = scale;
+  cinfo.dct_method = JDCT_IFAST;
+  jpeg_start_decompress(&cinfo);
+
+  width = cinfo.output_width;
+  height = cinfo.output_height;
+  rgb.resize(static_cast<std::size_t>(width) * height * 3);
+  while (cinfo.output_scanline < cinfo.output_height)
+  {
+    JSAMPROW row = &rgb[static_cast<std::size_t>(cinfo.output_scanline) * width * 3];
+    jpeg_read_scanlines(&cinfo, &row, 1);
+  }
+  jpeg_finish_decompress(&cinfo);
+  jpeg_destroy_decompress(&cinfo);
+  return true;
+}
+
+} // namespace
+
+std::vector<rendition>
+parse_ladder(std::string const& spec)
+{
+  std::vector<rendition> ladder;
+  std::size_t pos = 0;
+  while (pos <= spec.size())
+  {
+    auto const comma = std::min(spec.find(',', pos), spec.size());
+    auto const item = spec.substr(pos, comma - pos);
+    pos = comma + 1;
+
+    rendition r;
+    auto const colon = item.find(':');
+    char name[32];
+    if (colon == 0 || colon > sizeof(name) - 1 ||
+      std::sscanf(item.c_str(), "%31[^:]:%d:%d", name, &r.scale, &r.quality) != 3 ||
+      (r.scale != 1 && r.scale != 2 && r.scale != 4 && r.scale != 8) ||
+      r.quality < 1 || r.quality > 100)
+      throw std::invalid_argument("bad rendition \"" + item + "\", expected name:scale:quality");
+    r.name = name;
+    ladder.push_back(std::move(r));
+  }
+  return ladder;
+}
+
+live_ladder::live_ladder(std::vector<rendition> renditions)
+  : renditions_(std::move(renditions))
+{
+  for (std::size_t i = 0; i < renditions_.size(); ++i)
+    hubs_.push_back(std::make_unique<frame_hub>());
+}
+
+int
+live_ladder::find(std::string_view name) const
+{
+  for (std::size_t i = 0; i < renditions_.size(); ++i)
+    if (renditions_[i].name == name)
+      return static_cast<int>(i);
+  return -1;
+}
+
+std::size_t
+live_ladder::viewers() const
+{
+  std::size_t n = 0;
+  for (auto const& hub : hubs_)
+    n += hub->viewers();
+  return n;
+}
+
+void
+live_ladder::on_subscribe(std::function<void()> fn)
+{
+  for (auto const& hub : hubs_)
+    hub->on_subscribe(fn);
+}
+
+rendition_selector::rendition_selector(std::size_t top, std::size_t bottom)
+  : level_(top)
+  , top_(top)
+  , bottom_(bottom)
+  , clear_since_(std::chrono::steady_clock::now())
+{
+}
+
+std::size_t
+rendition_selector::update(std::size_t backlog, std::size_t frame_size)
+{
+  auto const now = std::chrono::steady_clock::now();
+  if (backlog > frame_size)
+  {
+    // More than a frame waits in the socket: the link can't keep up
+    clear_since_ = now;
+    if (++congested_ >= 3 && level_ < bottom_)
+    {
+      ++level_;
+      congested_ = 0;
+    }
+  }
+  else
+  {
+    // Try the next better rendition after 10 seconds without backlog
+    congested_ = 0;
+    if (now - clear_since_ > std::chrono::seconds(10) && level_ > top_)
+    {
+      --level_;
+      clear_since_ = now;
+    }
+  }
+  return level_;
+}
+
+std::size_t
+send_backlog(int native_socket)
+{
+  int queued = 0;
+  if (::ioctl(native_socket, SIOCOUTQ, &queued) != 0)
+    return 0;
+  return static_cast<std::size_t>(queued);
+}
+
+void
+frame_hub::on_subscribe(std::function<void()> fn)
+{
+  std::lock_guard<std::mutex> lock(mutex_);
+  on_subscribe_ = std::move(fn);
+}
+
+std::shared_ptr<void>
+frame_hub::subscribe()
+{
+  std::function<void()> fn;
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    ++viewers_;
+    fn = on_subscribe_;
+  }
+  if (fn)
+    fn();
+
+  return std::shared_ptr<void>(this,
+    [this](void*)
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      --viewers_;
+    });
+}
+
+std::size_t
+frame_hub::viewers()
+{
+  std::lock_guard<std::mutex> lock(mutex_);
+  return viewers_;
+}
+
+void
+frame_hub::publish(std::shared_ptr<frame const> f)
+{
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    latest_ = std::move(f);
+  }
+  cv_.notify_all();
+}
+
+std::shared_ptr<frame const>
+frame_hub::wait_next(std::uint64_t seq, std::chrono::milliseconds timeout)
+{
+  std::unique_lock<std::mutex> lock(mutex_);
+  cv_.wait_for(lock, timeout,
+    [&]
+    {
+      return latest_ && latest_->seq > seq;
+    });
+  if (latest_ && latest_->seq > seq)
+    return latest_;
+  return nullptr;
+}
+
+//------------------------------------------------------------------------------
+
+std::uint64_t
+frame_digest(std::uint8_t const* data, std::size_t size)
+{
+  constexpr std::uint64_t prime1 = 0x9e3779b185ebca87ull;
+  constexpr std::uint64_t prime2 = 0xc2b2ae3d27d4eb4full;
+
+  std::uint64_t lanes[4] = { prime1 + prime2, prime2, 0, 0 - prime1 };
+  std::size_t i = 0;
+  for (; i + 32 <= size; i += 32)
+  {
+    for (int l = 0; l < 4; ++l)
+    {
+      std::uint64_t word;
+      std::memcpy(&word, data + i + l * 8, 8);
+      lanes[l] = rotl(lanes[l] + word * prime2, 31) * prime1;
+    }
+  }
+
+  std::uint64_t h = rotl(lanes[0], 1) + rotl(lanes[1], 7) + rotl(lanes[2], 12) + rotl(lanes[3], 18);
+  for (; i < size; ++i)
+    h = rotl(h ^ (data[i] * prime1), 11) * prime2;
+  h ^= size;
+  h ^= h >> 33;
+  h *= prime2;
+  h ^= h >> 29;
+  return h;
+}
+
+static_frame_filter::verdict
+static_frame_filter::check(std::uint8_t const* data, std::size_t size)
+{
+  auto const now = std::chrono::steady_clock::now();
+  auto const digest = frame_digest(data, size);
+  if (digest != digest_ || size != size_)
+  {
+    digest_ = digest;
+    size_ = size;
+    changed_ = sent_ = now;
+    return changed;
+  }
+  if (now - sent_ >= keepalive_)
+  {
+    sent_ = now;
+    return repeat;
+  }
+  ++suppressed_;
+  return drop;
+}
+
+std::chrono::steady_clock::duration
+static_frame_filter::unchanged_for() const
+{
+  return std::chrono::steady_clock::now() - changed_;
+}
+
+//------------------------------------------------------------------------------
+
+// A mapped ring, unmapped when the last frame pinning it is gone
+struct shm_ingest::mapping
+{
+  frame_ring::ring_header* ring = nullptr;
+  std::size_t size = 0;
+  ino_t inode = 0;
+
+  ~mapping()
+  {
+    if (ring)
+      ::munmap(ring, size);
+  }
+};
+
+shm_ingest::shm_ingest(
+  net::io_context& ioc,
+  std::string name,
+  std::shared_ptr<live_ladder> ladder,
+  std::chrono::microseconds poll,
+  std::chrono::milliseconds keepalive)
+  : name_(std::move(name))
+  , ladder_(std::move(ladder))
+  , strand_(net::make_strand(ioc))
+  , timer_(strand_)
+  , poll_(poll)
+  , delay_(poll)
+  , filter_(keepalive)
+  , outputs_(ladder_->size())
+  , queued_(ladder_->size())
+{
+}
+
+shm_ingest::~shm_ingest()
+{
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    stop_ = true;
+  }
+  wake_.notify_one();
+  if (thread_.joinable())
+    thread_.join();
+}
+
+void
+shm_ingest::run()
+{
+  thread_ = std::thread([this] { run_transcoder(); });
+  net::dispatch(strand_,
+    [self = shared_from_this()]
+    {
+      self->do_poll();
+    });
+}
+
+void
+shm_ingest::transcode(frame source, std::vector<std::size_t> renditions)
+{
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+
+    // The frame waiting is outdated, this one is scaled in its place
+    if (job_)
+      for (auto const i : job_->renditions)
+        if (std::find(renditions.begin(), renditions.end(), i) == renditions.end())
+          renditions.push_back(i);
+    for (auto const i : renditions)
+      queued_[i] = filter_.digest();
+    job_ = transcode_job{ std::move(source), filter_.digest(), std::move(renditions) };
+  }
+  wake_.notify_one();
+}
+
+void
+shm_ingest::run_transcoder()
+{
+  for (;;)
+  {
+    transcode_job job;
+    {
+      std::unique_lock<std::mutex> lock(mutex_);
+      wake_.wait(lock, [this] { return stop_ || job_; });
+      if (stop_)
+        return;
+      job = std::move(*job_);
+      job_ = boost::none;
+    }
+
+    std::vector<encoded> jpegs;
+    for (auto const i : job.renditions)
+    {
+      auto const& r = ladder_->at(i);
+      std::vector<std::uint8_t> rgb;
+      int width = 0, height = 0;
+      if (!decode_jpeg(job.source.data, job.source.size, r.scale, rgb, width, height))
+        continue;
+      auto jpeg = encode_jpeg(rgb.data(), width, height, r.quality);
+      if (!jpeg.empty())
+        jpegs.emplace_back(i, std::make_shared<std::vector<std::uint8_t> const>(std::move(jpeg)));
+    }
+
+    // Release the slot before the frames are published
+    job.source.owner.reset();
+    if (jpegs.empty())
+      continue;
+
+    // Don't hold the ingest alive, its destructor joins this thread
+    net::post(strand_,
+      [weak = weak_from_this(), digest = job.digest, jpegs = std::move(jpegs)]() mutable
+      {
+        if (auto const self = weak.lock())
+          self->on_transcoded(digest, std::move(jpegs));
+      });
+  }
+}
+
+void
+shm_ingest::on_transcoded(std::uint64_t digest, std::vector<encoded> jpegs)
+{
+  auto const now = std::chrono::steady_clock::now();
+  for (auto& e : jpegs)
+  {
+    auto& out = outputs_[e.first];
+    out.digest = digest;
+    out.jpeg = std::move(e.second);
+    out.sent = now;
+
+    auto& hub = ladder_->hub(e.first);
+    if (hub.viewers() != 0)
+      hub.publish(std::make_shared<frame const>(
+        frame{ out.jpeg->data(), out.jpeg->size(), ++frames_, out.jpeg }));
+  }
+}
+
+bool
+shm_ingest::replaced() const
+{
+  int const fd = ::shm_open(name_.c_str(), O_RDONLY, 0);
+  if (fd < 0)
+    return false;
+  struct stat st;
+  bool const other = ::fstat(fd, &st) == 0 && st.st_ino != map_->inode;
+  ::close(fd);
+  return other;
+}
+
+bool
+shm_ingest::open()
+{
+  int const fd = ::shm_open(name_.c_str(), O_RDWR, 0);
+  if (fd < 0)
+    return false;
+
+  struct stat st;
+  void* addr = MAP_FAILED;
+  if (::fstat(fd, &st) == 0 && static_cast<std::size_t>(st.st_size) >= sizeof(frame_ring::ring_header))
+    addr = ::mmap(nullptr, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  ::close(fd);
+  if (addr == MAP_FAILED)
+    return false;
+
+  auto map = std::make_shared<mapping>();
+  map->ring = static_cast<frame_ring::ring_header*>(addr);
+  map->size = st.st_size;
+  map->inode = st.st_ino;
+
+  auto const& ring = *map->ring;
+  if (ring.magic != frame_ring::magic ||
+    ring.version != frame_ring::version ||
+    ring.slot_count == 0 ||
+    ring.slot_count > frame_ring::max_slots ||
+    frame_ring::mapping_size(ring.slot_count, ring.slot_capacity) > map->size)
+  {
+    spdlog::debug("Shared memory {} is not a frame ring", name_);
+    return false;
+  }
+
+  spdlog::info("Ingesting frames from shared memory {} ({} slots of {} bytes)",
+    name_, ring.slot_count, ring.slot_capacity);
+  map_ = std::move(map);
+  return true;
+}
+
+void
+shm_ingest::do_poll()
+{
+  // Wait for the producer to create the ring
+  if (!map_ && !open())
+  {
+    timer_.expires_after(std::chrono::seconds(1));
+    return timer_.async_wait(
+      [self = shared_from_this()](boost::system::error_code ec)
+      {
+        if (!ec)
+          self->do_poll();
+      });
+  }
+
+  // A restarted producer may have created a new ring
+  auto const now = std::chrono::steady_clock::now();
+  if (now - last_frame_ > std::chrono::seconds(1))
+  {
+    last_frame_ = now;
+    if (replaced())
+    {
+      spdlog::info("Shared memory {} was recreated", name_);
+      map_.reset();
+      last_ = 0;
+      delay_ = poll_;
+      return do_poll();
+    }
+  }
+
+  auto* const ring = map_->ring;
+  auto const published = ring->published.load(std::memory_order_acquire);
+  auto const seq = published >> 8;
+  auto const slot = static_cast<std::uint32_t>(published & 0xff);
+
+  // Back off once the producer is idle or gone, up to the interval at
+  // which a missing ring is looked for, and poll fast again on a frame
+  if (seq > last_)
+  {
+    seen_ = now;
+    delay_ = poll_;
+  }
+  else if (now - seen_ > std::chrono::seconds(1))
+    delay_ = std::min<std::chrono::microseconds>(delay_ * 2, std::chrono::seconds(1));
+
+  if (seq > last_ && slot < ring->slot_count)
+  {
+    auto& header = frame_ring::slots(ring)[slot];
+    header.readers.fetch_add(1);
+    if (header.seq.load() == seq * 2 && header.size <= ring->slot_capacity)
+    {
+      // The slot is pinned until the last viewer drops the frame
+      auto const pin = std::shared_ptr<void const>(
+        map_.get(),
+        [map = map_, slot](void const*)
+        {
+          frame_ring::slots(map->ring)[slot].readers.fetch_sub(1);
+        });
+      auto const* data = frame_ring::slot_data(ring, slot);
+      auto const verdict = filter_.check(data, header.size);
+
+      std::vector<std::size_t> scaled;
+      for (std::size_t i = 0; i < ladder_->size(); ++i)
+      {
+        auto& hub = ladder_->hub(i);
+        if (hub.viewers() == 0)
+          continue;
+
+        auto const& r = ladder_->at(i);
+        if (r.scale == 1)
+        {
+          if (verdict != static_frame_filter::drop)
+            hub.publish(std::make_shared<frame const>(frame{ data, header.size, ++frames_, pin }));
+          continue;
+        }
+
+        // A changed frame is scaled by the transcoder, which
+        // publishes it; keepalives repeat the last one from here
+        auto& out = outputs_[i];
+        bool const stale = !out.jpeg || out.digest != filter_.digest();
+        if (stale)
+        {
+          if (queued_[i] != filter_.digest())
+            scaled.push_back(i);
+          continue;
+        }
+        if (now - out.sent < filter_.keepalive())
+          continue;
+        out.sent = now;
+        hub.publish(std::make_shared<frame const>(
+          frame{ out.jpeg->data(), out.jpeg->size(), ++frames_, out.jpeg }));
+      }
+      if (!scaled.empty())
+        transcode(frame{ data, header.size, seq, pin }, std::move(scaled));
+    }
+    else
+    {
+      // Overwritten while we looked at it, the next one will do
+      header.readers.fetch_sub(1);
+    }
+    last_ = seq;
+    last_frame_ = now;
+  }
+
+  timer_.expires_after(delay_);
+  timer_.async_wait(
+    [self = shared_from_this()](boost::system::error_code ec)
+    {
+      if (!ec)
+        self->do_poll();
+    });
+}
+
+//------------------------------------------------------------------------------
+
+screen_capture::screen_capture(capture_config const& config, std::shared_ptr<live_ladder> ladder)
+  : config_(config)
+  , ladder_(std::move(ladder))
+{
+}
+
+screen_capture::~screen_capture()
+{
+  std::thread thread;
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    stop_ = true;
+    thread = std::move(thread_);
+  }
+  if (thread.joinable())
+    thread.join();
+}
+
+void
+screen_capture::ensure_running()
+{
+  std::thread previous;
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (running_ || stop_)
+      return;
+    running_ = true;
+    previous = std::move(thread_);
+    thread_ = std::thread([this] { run(); });
+  }
+
+  // The previous capture saw no viewer and is exiting
+  if (previous.joinable())
+    previous.join();
+}
+
+void
+screen_capture::run()
+{
+  // The native size of the screen unless scaling was asked for
+  int width = config_.width, height = config_.height;
+  if (width <= 0 || height <= 0)
+  {
+    if (!probe_screen_size(width, height))
+    {
+      spdlog::debug("Failed to probe the screen size.");
+      std::lock_guard<std::mutex> lock(mutex_);
+      running_ = false;
+      return;
+    }
+  }
+
+  // Fix the size, keeping the aspect ratio when scaling, so that every
+  // frame has the same size. GStreamer pads RGB rows to 4 bytes.
+  auto const gst_cmd = fmt::format(
+    "gst-launch-1.0 -q ximagesrc use-damage=0 ! "
+    "video/x-raw,framerate={}/1 ! videoconvert ! videoscale add-borders=true ! "
+    "video/x-raw,format=RGB,width={},height={} ! fdsink fd=1",
+    config_.framerate, width, height);
+  auto const row = static_cast<std::size_t>(width) * 3;
+  auto const stride = (row + 3) & ~std::size_t{ 3 };
+
+  FILE* pipe = popen(gst_cmd.c_str(), "r");
+  if (!pipe)
+    spdlog::debug("Failed to launch GStreamer capture pipeline.");
+  else
+    spdlog::info("Screen capture started ({}x{} at {} fps)", width, height, config_.framerate);
+
+  std::vector<std::uint8_t> raw(stride * height);
+  static_frame_filter filter(config_.keepalive);
+  std::vector<rendition_output> outputs(ladder_->size());
+  std::uint64_t encoded = 0, sent = 0;
+  bool idle = false;
+  auto const idle_period = std::chrono::microseconds(1000000 / std::max(1, config_.idle_framerate));
+
+  while (pipe && !stop_)
+  {
+    // Stop with the last viewer; under the lock so that
+    // ensure_running() either sees us running or starts a new capture
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      if (ladder_->viewers() == 0)
+      {
+        running_ = false;
+        idle = true;
+        break;
+      }
+    }
+
+    if (std::fread(raw.data(), 1, raw.size(), pipe) != raw.size())
+    {
+      spdlog::debug("GStreamer capture pipeline ended");
+      break;
+    }
+
+    // Pack the rows, the frame is then width * height * 3 bytes
+    if (stride != row)
+      for (int y = 1; y < height; ++y)
+        std::memmove(&raw[y * row], &raw[y * stride], row);
+    auto const frame_size = row * height;
+
+    filter.check(raw.data(), frame_size);
+    bool published = false;
+    for (std::size_t i = 0; i < ladder_->size(); ++i)
+    {
+      auto& hub = ladder_->hub(i);
+      if (hub.viewers() == 0)
+        continue;
+
+      // Encode each rendition once per change, a keepalive
+      // sends the last encoded frame again
+      auto& out = outputs[i];
+      auto const now = std::chrono::steady_clock::now();
+      bool const stale = !out.jpeg || out.digest != filter.digest();
+      if (!stale && now - out.sent < config_.keepalive)
+        continue;
+      if (stale)
+      {
+        auto const& r = ladder_->at(i);
+        auto jpeg = r.scale == 1
+          ? encode_jpeg(raw.data(), width, height, r.quality)
+          : encode_jpeg(
+            downscale(raw.data(), width, height, r.scale).data(),
+            width / r.scale, height / r.scale, r.quality);
+        if (jpeg.empty())
+          continue;
+        out.digest = filter.digest();
+        out.jpeg = std::make_shared<std::vector<std::uint8_t> const>(std::move(jpeg));
+        ++encoded;
+      }
+
+      out.sent = now;
+      hub.publish(std::make_shared<frame const>(
+        frame{ out.jpeg->data(), out.jpeg->size(), ++frames_, out.jpeg }));
+      ++sent;
+      published = true;
+    }
+
+    // Nothing moves: read slower, the pipeline blocks on the pipe meanwhile
+    if (!published && filter.unchanged_for() >= config_.keepalive)
+      std::this_thread::sleep_for(idle_period);
+  }
+
+  spdlog::info("Screen capture stopped: {} frames encoded, {} sent, {} suppressed",
+    encoded, sent, filter.suppressed());
+  if (pipe)
+    pclose(pipe);
+
+  // Failed or stopped: the next viewer starts a new capture
+  if (!idle)
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    running_ = false;
+  }
+}
@@ -0,0 +1,335 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+#include <boost/asio/io_context.hpp>
+#include <boost/asio/steady_timer.hpp>
+#include <boost/asio/strand.hpp>
+#include <boost/optional.hpp>
+#include "frame_ring.hpp"
+
+namespace net = boost::asio;            // from <boost/asio.hpp>
+
+// An encoded JPEG frame. The bytes stay valid as long as the
+// frame is referenced, wherever they live (heap or shared memory).
+struct frame
+{
+  std::uint8_t const* data;
+  std::size_t size;
+  std::uint64_t seq;
+  std::shared_ptr<void const> owner;
+};
+
+// Broadcasts the latest frame of a live source to its viewers.
+// A viewer which is slower than the source skips frames instead
+// of queueing them.
+class frame_hub
+{
+  std::mutex mutex_;
+  std::condition_variable cv_;
+  std::shared_ptr<frame const> latest_;
+  std::function<void()> on_subscribe_;
+  std::size_t viewers_ = 0;
+
+public:
+  // Called for every new viewer, e.g. to start a capture
+  void
+    on_subscribe(std::function<void()> fn);
+
+  // Register a viewer for as long as the token is held
+  std::shared_ptr<void>
+    subscribe();
+
+  std::size_t
+    viewers();
+
+  void
+    publish(std::shared_ptr<frame const> f);
+
+  // Wait for a frame newer than `seq`, returns nullptr on timeout
+  std::shared_ptr<frame const>
+    wait_next(std::uint64_t seq, std::chrono::milliseconds timeout);
+};
+
+// One output of a live source: the source scaled down by `scale`
+// (1, 2, 4 or 8) and encoded at `quality`
+struct rendition
+{
+  std::string name;
+  int scale = 1;
+  int quality = 80;
+};
+
+// Parse "name:scale:quality,...", largest rendition first
+std::vector<rendition>
+parse_ladder(std::string const& spec);
+
+// The renditions of a live source, each with its own hub. A source
+// encodes a rendition once per frame, and only while it has viewers.
+class live_ladder
+{
+  std::vector<rendition> renditions_;
+  std::vector<std::unique_ptr<frame_hub>> hubs_;
+
+public:
+  explicit live_ladder(std::vector<rendition> renditions);
+
+  std::size_t
+    size() const
+  {
+    return renditions_.size();
+  }
+
+  rendition const&
+    at(std::size_t i) const
+  {
+    return renditions_[i];
+  }
+
+  frame_hub&
+    hub(std::size_t i) const
+  {
+    return *hubs_[i];
+  }
+
+  // Returns -1 if there is no such rendition
+  int
+    find(std::string_view name) const;
+
+  // Viewers of all renditions
+  std::size_t
+    viewers() const;
+
+  // Called for every new viewer of any rendition
+  void
+    on_subscribe(std::function<void()> fn);
+};
+
+// Moves a viewer down the ladder while frames pile up in its socket
+// send queue, and back up after a while without backlog.
+class rendition_selector
+{
+  std::size_t level_;
+  std::size_t top_;
+  std::size_t bottom_;
+  int congested_ = 0;
+  std::chrono::steady_clock::time_point clear_since_;
+
+public:
+  // `top` and `bottom` are the best and worst renditions allowed
+  rendition_selector(std::size_t top, std::size_t bottom);
+
+  std::size_t
+    level() const
+  {
+    return level_;
+  }
+
+  // Called after a frame was written, with the bytes still queued
+  // in the socket. Returns the rendition for the next frame.
+  std::size_t
+    update(std::size_t backlog, std::size_t frame_size);
+};
+
+// Bytes written to a socket but not sent yet
+std::size_t
+send_backlog(int native_socket);
+
+// 64-bit digest of a frame, processing 32 bytes per step in four
+// independent lanes so it runs at memory speed.
+std::uint64_t
+frame_digest(std::uint8_t const* data, std::size_t size);
+
+// Drops frames identical to the previous one, but repeats the previous
+// one every `keepalive` so viewers and proxies see the stream is alive.
+// The send rate thus falls to the keepalive rate on static content.
+class static_frame_filter
+{
+public:
+  enum verdict
+  {
+    drop,    // same as the previous frame
+    changed, // send it
+    repeat   // same as the previous frame, but send it as a keepalive
+  };
+
+  explicit static_frame_filter(std::chrono::milliseconds keepalive)
+    : keepalive_(keepalive)
+  {
+  }
+
+  verdict
+    check(std::uint8_t const* data, std::size_t size);
+
+  std::chrono::milliseconds
+    keepalive() const
+  {
+    return keepalive_;
+  }
+
+  // Digest of the last frame checked
+  std::uint64_t
+    digest() const
+  {
+    return digest_;
+  }
+
+  // Time since the content last changed
+  std::chrono::steady_clock::duration
+    unchanged_for() const;
+
+  std::uint64_t
+    suppressed() const
+  {
+    return suppressed_;
+  }
+
+private:
+  std::chrono::milliseconds keepalive_;
+  std::uint64_t digest_ = 0;
+  std::size_t size_ = 0;
+  std::chrono::steady_clock::time_point changed_;
+  std::chrono::steady_clock::time_point sent_;
+  std::uint64_t suppressed_ = 0;
+};
+
+// An encoded rendition of the current frame
+struct rendition_output
+{
+  std::uint64_t digest = 0; // of the source frame
+  std::shared_ptr<std::vector<std::uint8_t> const> jpeg;
+  std::chrono::steady_clock::time_point sent;
+};
+
+// Reads the frames an external producer writes into a frame_ring in
+// POSIX shared memory and publishes them to a ladder. Full size
+// renditions get the producer's frames, pinning each slot instead of
+// copying it; smaller ones are decoded at a reduced scale and encoded
+// on a thread of their own, off the io_context.
+class shm_ingest : public std::enable_shared_from_this<shm_ingest>
+{
+  struct mapping;
+
+  // A frame to scale for some renditions; a newer one replaces it
+  // if the transcoder didn't take it yet
+  struct transcode_job
+  {
+    frame source;
+    std::uint64_t digest;
+    std::vector<std::size_t> renditions;
+  };
+
+  using encoded = std::pair<std::size_t, std::shared_ptr<std::vector<std::uint8_t> const>>;
+
+  std::string name_;
+  std::shared_ptr<live_ladder> ladder_;
+  net::strand<net::io_context::executor_type> strand_;
+  net::steady_timer timer_;
+  std::chrono::microseconds poll_;
+  std::chrono::microseconds delay_; // grows from poll_ once no frame came for a second
+  std::chrono::steady_clock::time_point seen_; // when the last new frame was seen
+  std::shared_ptr<mapping> map_;
+  std::uint64_t last_ = 0;   // producer sequence of the last frame seen
+  std::uint64_t frames_ = 0; // frames published, survives producer restarts
+  std::chrono::steady_clock::time_point last_frame_;
+  static_frame_filter filter_;
+  std::vector<rendition_output> outputs_;
+  std::vector<std::uint64_t> queued_; // digest handed to the transcoder, per rendition
+
+  std::mutex mutex_;
+  std::condition_variable wake_;
+  boost::optional<transcode_job> job_;
+  bool stop_ = false;
+  std::thread thread_;
+
+public:
+  shm_ingest(
+    net::io_context& ioc,
+    std::string name,
+    std::shared_ptr<live_ladder> ladder,
+    std::chrono::microseconds poll,
+    std::chrono::milliseconds keepalive);
+
+  ~shm_ingest();
+
+  // Start polling the ring
+  void
+    run();
+
+private:
+  void
+    do_poll();
+
+  // Hand a frame to the transcoder
+  void
+    transcode(frame source, std::vector<std::size_t> renditions);
+
+  void
+    run_transcoder();
+
+  // On the strand, with the renditions of a transcoded frame
+  void
+    on_transcoded(std::uint64_t digest, std::vector<encoded> jpegs);
+
+  bool
+    open();
+
+  // Returns `true` if the name now refers to another segment
+  bool
+    replaced() const;
+};
+
+struct capture_config
+{
+  // Size the capture is scaled to, 0 keeps the native size of the screen
+  int width = 0;
+  int height = 0;
+  int framerate = 30;
+
+  // Capture rate once the screen stayed unchanged for `keepalive`
+  int idle_framerate = 5;
+
+  // Interval at which an unchanged screen is sent again
+  std::chrono::milliseconds keepalive{ 1000 };
+};
+
+// Captures the screen with a single GStreamer pipeline shared by all
+// viewers. Raw frames are compared through their digest and only the
+// changed ones are scaled and encoded, once per watched rendition, so
+// an idle desktop costs neither encoder CPU nor bandwidth; keepalives
+// repeat the last encoded frames. While
+// idle, frames are read at `idle_framerate`, which blocks the pipeline
+// and slows the capture down too. The capture runs while the hub has
+// viewers.
+class screen_capture
+{
+  capture_config config_;
+  std::shared_ptr<live_ladder> ladder_;
+  std::mutex mutex_;
+  std::thread thread_;
+  bool running_ = false;
+  std::atomic<bool> stop_{ false };
+  std::atomic<std::uint64_t> frames_{ 0 }; // frames published, survives restarts
+
+public:
+  screen_capture(capture_config const& config, std::shared_ptr<live_ladder> ladder);
+
+  ~screen_capture();
+
+  // Start the capture if it isn't running
+  void
+    ensure_running();
+
+private:
+  void
+    run();
+};
@@ -1,7 +1,52 @@
 #include <spdlog/spdlog.h>
+#include <cstdio>
+#include <fstream>
+#include <future>
 #include <iostream>
+#include <map>
+#include <boost/asio/steady_timer.hpp>
+#include <boost/asio/thread_pool.hpp>
+#include "handover.hpp"
 #include "server.hpp"
 
+// Collect the optional "--name=value" arguments
+std::map<std::string, std::string>
+parse_options(int argc, char* argv[], int first)
+{
+  std::map<std::string, std::string> options;
+  for (int i = first; i < argc; ++i)
+  {
+    std::string const arg = argv[i];
+    if (arg.rfind("--", 0) != 0)
+      throw std::invalid_argument("unexpected argument " + arg);
+    auto const eq = arg.find('=');
+    if (eq == std::string::npos)
+      options[arg.substr(2)] = "1";
+    else
+      options[arg.substr(2, eq - 2)] = arg.substr(eq + 1);
+  }
+  return options;
+}
+
+// Parse a byte count or rate with an optional k/m/g suffix
+std::uint64_t
+parse_size(std::map<std::string, std::string> const& options, std::string const& name, std::uint64_t def)
+{
+  auto const it = options.find(name);
+  if (it == options.end())
+    return def;
+  std::size_t pos = 0;
+  std::uint64_t value = std::stoull(it->second, &pos);
+  switch (pos < it->second.size() ? std::tolower(it->second[pos]) : 0)
+  {
+  case 'g': value <<= 10; // fallthrough
+  case 'm': value <<= 10; // fallthrough
+  case 'k': value <<= 10; break;
+  default: break;
+  }
+  return value;
+}
+
 int main(int argc, char* argv[])
 {
   try
@@ -10,37 +55,227 @@ int main(int argc, char* argv[])
     spdlog::set_pattern("%^[%D %T][%t][%L]%$ %v");
 
     // Check command line arguments.
-    if (argc != 3)
+    if (argc < 3)
     {
-      spdlog::debug("Usage: advanced-server <doc_root> <threads>");
+      spdlog::debug("Usage: advanced-server <doc_root> <threads> [--option=value ...]");
       return EXIT_FAILURE;
     }
+    auto const options = parse_options(argc, argv, 3);
     auto const address = net::ip::make_address("0.0.0.0");
     auto const port = static_cast<unsigned short>(std::atoi("8080"));
-    auto const doc_root = std::make_shared<std::string>(argv[1]);
     auto const threads = std::max<int>(1, std::atoi(argv[2]));
     spdlog::info("Starting server at http://0.0.0.0:8080 with {} worker_thread(s)", threads);
 
+    // Egress pacing, all rates in bytes per second
+    pacing_config pacing;
+    pacing.connection_rate = parse_size(options, "pace-conn", 0);
+    pacing.client_rate = parse_size(options, "pace-client", 0);
+    pacing.egress_rate = parse_size(options, "egress-rate", 0);
+    pacing.kernel_pacing = parse_size(options, "pace-kernel", 0) != 0;
+    pacing.chunk_size = parse_size(options, "pace-chunk", pacing.chunk_size);
+    pacing.early_bytes = parse_size(options, "pace-early", pacing.early_bytes);
+
     // The io_context is required for all I/O
     net::io_context ioc{ threads };
 
-    // Create and launch a listening port
-    std::make_shared<listener>(
-      ioc,
-      tcp::endpoint{ address, port },
-      doc_root)
-      ->run();
+    auto const state = std::make_shared<server_state>();
+    state->doc_root = argv[1];
+    state->pacer = std::make_shared<egress_pacer>(ioc, pacing);
+    state->sessions = std::make_shared<session_registry>();
+
+    // Compressed text assets, 0 disables on-the-fly compression
+    auto const compress_cache = parse_size(options, "compress-cache", 64 << 20);
+    if (compress_cache)
+      state->compressor = std::make_shared<compression_cache>(
+        compress_cache,
+        parse_size(options, "compress-max", 8 << 20),
+        std::max<std::size_t>(1, parse_size(options, "compress-threads", 1)));
+
+    // Chunk cache in front of a slow doc_root, enabled by a RAM
+    // or disk tier
+    if (options.count("cache-ram") || options.count("cache-dir"))
+    {
+      chunk_cache_config cache;
+      cache.chunk_size = parse_size(options, "cache-chunk", cache.chunk_size);
+      cache.ram_capacity = parse_size(options, "cache-ram", cache.ram_capacity);
+      if (options.count("cache-dir"))
+        cache.disk_dir = options.at("cache-dir");
+      cache.disk_capacity = parse_size(options, "cache-disk", cache.disk_capacity);
+      cache.origin_delay = std::chrono::milliseconds(parse_size(options, "origin-delay-ms", 0));
+      cache.stat_ttl = std::chrono::milliseconds(parse_size(options, "cache-stat-ms", 1000));
+      cache.threads = std::max<std::size_t>(1, parse_size(options, "cache-threads", cache.threads));
+      state->chunks = std::make_shared<chunk_cache>(cache);
+    }
+
+    // Renditions of /stream, largest first: unchanged frames are only
+    // repeated every keepalive
+    state->live = std::make_shared<live_ladder>(parse_ladder(
+      options.count("stream-ladder") ? options.at("stream-ladder") : "high:1:80,medium:2:65,low:4:50"));
+    auto const keepalive = std::chrono::milliseconds(parse_size(options, "stream-keepalive-ms", 1000));
+
+    // Frames written to shared memory by an external producer replace
+    // the screen capture
+    if (options.count("ingest"))
+    {
+      std::make_shared<shm_ingest>(
+        ioc,
+        options.at("ingest"),
+        state->live,
+        std::chrono::microseconds(parse_size(options, "ingest-poll-us", 1000)),
+        keepalive)
+        ->run();
+    }
+    else
+    {
+      capture_config capture;
+      if (options.count("capture-size") &&
+        std::sscanf(options.at("capture-size").c_str(), "%dx%d", &capture.width, &capture.height) != 2)
+        throw std::invalid_argument("--capture-size must be <width>x<height>");
+      capture.framerate = static_cast<int>(parse_size(options, "capture-fps", capture.framerate));
+      capture.idle_framerate = static_cast<int>(parse_size(options, "capture-idle-fps", capture.idle_framerate));
+      capture.keepalive = keepalive;
+      state->capture = std::make_shared<screen_capture>(capture, state->live);
+
+      // Capture only while someone watches
+      state->live->on_subscribe(
+        [capture = std::weak_ptr<screen_capture>(state->capture)]
+        {
+          if (auto const c = capture.lock())
+            c->ensure_running();
+        });
+    }
+
+    // Sampled request tracing, controlled by SIGUSR1 and, when
+    // enabled, by /admin/trace
+    trace_config trace;
+    trace.sample = std::max<std::uint64_t>(1, parse_size(options, "trace-sample", trace.sample));
+    trace.buffer = parse_size(options, "trace-buffer", trace.buffer);
+    auto const trace_file = options.count("trace-file") ? options.at("trace-file") : std::string("file_server-trace.json");
+    if (options.count("trace-admin"))
+      state->tracer = std::make_shared<trace_config const>(trace);
+
+    // Exports of /admin/trace are built here, off the I/O threads
+    net::thread_pool background{ 1 };
+    state->background = background.get_executor();
+    if (options.count("trace"))
+      start_tracing(trace);
+
+    // Seconds given to the sessions to finish their responses on shutdown,
+    // 0 stops at once
+    auto const drain_timeout = std::chrono::seconds(parse_size(options, "drain-timeout", 30));
+
+    // Unix socket used to pass the listening socket to the next process
+    auto const handover_path = options.count("handover") ? options.at("handover") : std::string();
+
+    // Create and launch a listening port, taking it
+    // over from a running server if there is one
+    int const inherited = handover_path.empty() ? -1 : request_listener(handover_path);
+    auto const acceptor = inherited >= 0
+      ? std::make_shared<listener>(ioc, inherited, state)
+      : std::make_shared<listener>(ioc, tcp::endpoint{ address, port }, state);
+    acceptor->run();
+
+    // Stop accepting, let the sessions finish their current
+    // response, then stop once they are gone or at the deadline.
+    net::steady_timer drain_timer(ioc);
+    std::atomic<bool> draining{ false };
+    auto const drain =
+      [&]
+      {
+        if (draining.exchange(true))
+          return;
+        spdlog::info("Draining {} connection(s) for up to {}s",
+          state->sessions->size(), drain_timeout.count());
+        acceptor->stop();
+        drain_timer.expires_after(drain_timeout);
+        drain_timer.async_wait(
+          [&ioc](beast::error_code ec)
+          {
+            if (!ec)
+              ioc.stop();
+          });
+        state->sessions->drain(
+          [&ioc]
+          {
+            ioc.stop();
+          });
+      };
+
+    if (!handover_path.empty())
+      std::make_shared<handover_server>(
+        ioc,
+        handover_path,
+        acceptor->native_handle(),
+        drain)
+        ->run();
 
     // Capture SIGINT and SIGTERM to perform a clean shutdown
     net::signal_set signals(ioc, SIGINT, SIGTERM);
-    signals.async_wait(
-      [&](beast::error_code const&, int)
+    std::function<void(beast::error_code const&, int)> on_signal =
+      [&](beast::error_code const& ec, int)
       {
-        // Stop the `io_context`. This will cause `run()`
-        // to return immediately, eventually destroying the
-        // `io_context` and all of the sockets in it.
-        ioc.stop();
-      });
+        if (ec)
+          return;
+
+        // A second signal, or no drain timeout, stops the `io_context`
+        // at once. This will cause `run()` to return immediately,
+        // eventually destroying the `io_context` and all of the sockets in it.
+        if (drain_timeout.count() == 0 || draining)
+          return ioc.stop();
+
+        drain();
+        signals.async_wait(on_signal);
+      };
+    signals.async_wait(on_signal);
+
+    // Capture SIGUSR2 to restart without refusing connections:
+    // a new process takes the listening socket over, then we drain.
+    net::signal_set restart(ioc, SIGUSR2);
+    std::function<void(beast::error_code const&, int)> on_restart =
+      [&](beast::error_code const& ec, int)
+      {
+        if (ec)
+          return;
+        if (handover_path.empty())
+          spdlog::info("Restart ignored, no --handover socket");
+        else
+          spawn_successor(argv);
+        restart.async_wait(on_restart);
+      };
+    restart.async_wait(on_restart);
+
+    // Capture SIGUSR1 to start tracing, or to stop it and write
+    // the trace to --trace-file on a thread of its own
+    net::signal_set trace_signal(ioc, SIGUSR1);
+    std::future<void> trace_export;
+    std::function<void(beast::error_code const&, int)> on_trace =
+      [&](beast::error_code const& ec, int)
+      {
+        if (ec)
+          return;
+        if (trace_export.valid() &&
+          trace_export.wait_for(std::chrono::seconds(0)) != std::future_status::ready)
+        {
+          spdlog::warn("The trace is still being written to {}", trace_file);
+        }
+        else if (!tracing())
+        {
+          start_tracing(trace);
+          spdlog::info("Tracing 1 in {} requests", trace.sample);
+        }
+        else
+        {
+          stop_tracing();
+          trace_export = std::async(std::launch::async,
+            [trace_file]
+            {
+              std::ofstream(trace_file) << export_trace();
+              spdlog::info("Trace written to {}", trace_file);
+            });
+        }
+        trace_signal.async_wait(on_trace);
+      };
+    trace_signal.async_wait(on_trace);
 
     // Run the I/O service on the requested number of threads
     std::vector<std::thread> v;
@@ -53,12 +288,16 @@ int main(int argc, char* argv[])
         });
     ioc.run();
 
-    // (If we get here, it means we got a SIGINT or SIGTERM)
+    // (If we get here, it means we got a SIGINT or SIGTERM, or we drained)
 
     // Block until all the threads exit
     for (auto& t : v)
       t.join();
 
+    // Wait for the jobs still writing live streams, their
+    // sockets go away with the io_context
+    state->sessions->stop_jobs();
+
     return EXIT_SUCCESS;
   }
   catch (const std::exception& e)
@@ -0,0 +1,296 @@
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <future>
+#include <thread>
+#include <sys/socket.h>
+#include <boost/asio/dispatch.hpp>
+#include <boost/asio/post.hpp>
+#include <boost/core/ignore_unused.hpp>
+#include <boost/make_unique.hpp>
+#include <spdlog/spdlog.h>
+#include "pacing.hpp"
+
+token_bucket::token_bucket(std::uint64_t rate, std::uint64_t burst)
+  : rate_(static_cast<double>(rate))
+  , burst_(static_cast<double>(burst))
+  , tokens_(static_cast<double>(burst))
+  , last_(clock::now())
+{
+}
+
+std::chrono::nanoseconds
+token_bucket::consume(std::size_t bytes)
+{
+  std::lock_guard<std::mutex> lock(mutex_);
+  auto const now = clock::now();
+  std::chrono::duration<double> const elapsed = now - last_;
+  last_ = now;
+  tokens_ = std::min(burst_, tokens_ + elapsed.count() * rate_);
+  tokens_ -= static_cast<double>(bytes);
+  if (tokens_ >= 0)
+    return std::chrono::nanoseconds::zero();
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(
+    std::chrono::duration<double>(-tokens_ / rate_));
+}
+
+//------------------------------------------------------------------------------
+
+fair_scheduler::fair_scheduler(net::io_context& ioc, std::uint64_t rate, std::size_t quantum)
+  : strand_(net::make_strand(ioc))
+  , timer_(strand_)
+  , rate_(static_cast<double>(rate))
+  , quantum_(quantum)
+  , flows_{ { flow{ 8 }, flow{ 4 }, flow{ 1 } } }
+  , link_free_(clock::now())
+{
+}
+
+void
+fair_scheduler::async_acquire(
+  traffic_class cls,
+  std::size_t bytes,
+  net::any_io_executor ex,
+  std::function<void()> fn)
+{
+  net::dispatch(
+    strand_,
+    [self = shared_from_this(), cls, bytes, ex = std::move(ex), fn = std::move(fn)]() mutable
+    {
+      self->flows_[static_cast<std::size_t>(cls)].pending.push_back(
+        grant{ bytes, std::move(ex), std::move(fn) });
+      if (!self->waiting_)
+        self->service();
+    });
+}
+
+void
+fair_scheduler::service()
+{
+  // Let a small burst through immediately so an idle link never adds latency
+  auto const slack = std::chrono::duration_cast<clock::duration>(
+    std::chrono::duration<double>(static_cast<double>(quantum_) / rate_));
+  auto const now = clock::now();
+  link_free_ = std::max(link_free_, now - slack);
+
+  auto const has_pending = [this]
+    {
+      return std::any_of(flows_.begin(), flows_.end(),
+        [](flow const& f) { return !f.pending.empty(); });
+    };
+
+  while (has_pending() && link_free_ <= now)
+  {
+    auto& f = flows_[select()];
+    auto g = std::move(f.pending.front());
+    f.pending.pop_front();
+    link_free_ += std::chrono::duration_cast<clock::duration>(
+      std::chrono::duration<double>(static_cast<double>(g.bytes) / rate_));
+    net::post(g.ex, std::move(g.fn));
+  }
+
+  waiting_ = has_pending();
+  if (!waiting_)
+    return;
+
+  timer_.expires_at(link_free_);
+  timer_.async_wait(
+    [self = shared_from_this()](beast::error_code ec)
+    {
+      if (ec)
+        return;
+      self->service();
+    });
+}
+
+std::size_t
+fair_scheduler::select()
+{
+  // Deficit round robin: each visit credits a flow with quantum * weight
+  // bytes, and the flow is served while its head grant fits in the credit.
+  for (;;)
+  {
+    auto& f = flows_[cursor_];
+    if (f.pending.empty())
+    {
+      f.deficit = 0;
+    }
+    else
+    {
+      if (fresh_)
+      {
+        f.deficit += quantum_ * f.weight;
+        fresh_ = false;
+      }
+      if (f.pending.front().bytes <= f.deficit)
+      {
+        f.deficit -= f.pending.front().bytes;
+        return cursor_;
+      }
+    }
+    cursor_ = (cursor_ + 1) % flows_.size();
+    fresh_ = true;
+  }
+}
+
+//------------------------------------------------------------------------------
+
+egress_pacer::egress_pacer(net::io_context& ioc, pacing_config const& config)
+  : config_(config)
+{
+  if (config_.egress_rate)
+    scheduler_ = std::make_shared<fair_scheduler>(
+      ioc, config_.egress_rate, config_.chunk_size);
+}
+
+std::shared_ptr<token_bucket>
+egress_pacer::client_bucket(std::string const& address)
+{
+  if (!config_.client_rate)
+    return nullptr;
+
+  std::lock_guard<std::mutex> lock(mutex_);
+  auto& slot = clients_[address];
+  auto bucket = slot.lock();
+  if (!bucket)
+  {
+    bucket = std::make_shared<token_bucket>(config_.client_rate, config_.chunk_size * 4);
+    slot = bucket;
+  }
+
+  // Forget clients which have no connection left
+  if (clients_.size() > 1024)
+  {
+    for (auto it = clients_.begin(); it != clients_.end();)
+    {
+      if (it->second.expired())
+        it = clients_.erase(it);
+      else
+        ++it;
+    }
+  }
+  return bucket;
+}
+
+std::unique_ptr<token_bucket>
+egress_pacer::connection_bucket() const
+{
+  if (!config_.connection_rate)
+    return nullptr;
+  return boost::make_unique<token_bucket>(config_.connection_rate, config_.chunk_size * 4);
+}
+
+void
+egress_pacer::apply_socket_options(tcp::socket& socket) const
+{
+#ifdef SO_MAX_PACING_RATE
+  if (!config_.kernel_pacing || !config_.connection_rate)
+    return;
+  unsigned int const rate = static_cast<unsigned int>(
+    std::min<std::uint64_t>(config_.connection_rate, UINT32_MAX));
+  if (::setsockopt(socket.native_handle(), SOL_SOCKET, SO_MAX_PACING_RATE,
+    &rate, sizeof(rate)) != 0)
+    spdlog::debug("setsockopt(SO_MAX_PACING_RATE) failed: {}", std::strerror(errno));
+#else
+  boost::ignore_unused(socket);
+#endif
+}
+
+traffic_class
+egress_pacer::classify(beast::string_view content_type, std::uint64_t offset) const
+{
+  if (content_type.starts_with("multipart/x-mixed-replace"))
+    return traffic_class::live;
+  if (offset < config_.early_bytes)
+    return traffic_class::early_range;
+  return traffic_class::bulk;
+}
+
+void
+egress_pacer::async_acquire(
+  traffic_class cls,
+  std::size_t bytes,
+  net::any_io_executor ex,
+  std::function<void()> fn)
+{
+  if (!scheduler_)
+    return net::post(ex, std::move(fn));
+  scheduler_->async_acquire(cls, bytes, std::move(ex), std::move(fn));
+}
+
+//------------------------------------------------------------------------------
+
+connection_pacer::connection_pacer(std::shared_ptr<egress_pacer> pacer, tcp::socket& socket)
+  : pacer_(std::move(pacer)), timer_(socket.get_executor())
+{
+  beast::error_code ec;
+  auto const remote = socket.remote_endpoint(ec);
+  if (!ec)
+    client_bucket_ = pacer_->client_bucket(remote.address().to_string());
+  connection_bucket_ = pacer_->connection_bucket();
+  pacer_->apply_socket_options(socket);
+}
+
+std::chrono::nanoseconds
+connection_pacer::consume(std::size_t bytes)
+{
+  auto delay = std::chrono::nanoseconds::zero();
+  if (connection_bucket_)
+    delay = std::max(delay, connection_bucket_->consume(bytes));
+  if (client_bucket_)
+    delay = std::max(delay, client_bucket_->consume(bytes));
+  return delay;
+}
+
+void
+connection_pacer::async_pace(traffic_class cls, std::size_t bytes, std::function<void()> fn)
+{
+  auto acquire =
+    [pacer = pacer_, ex = timer_.get_executor(), cls, bytes, fn = std::move(fn)]() mutable
+    {
+      pacer->async_acquire(cls, bytes, ex, std::move(fn));
+    };
+
+  auto const delay = consume(bytes);
+  if (delay == std::chrono::nanoseconds::zero())
+    return acquire();
+
+  timer_.expires_after(delay);
+  timer_.async_wait(
+    [acquire = std::move(acquire)](beast::error_code ec) mutable
+    {
+      if (!ec)
+        acquire();
+    });
+}
+
+bool
+connection_pacer::pace(traffic_class cls, std::size_t bytes, std::atomic<bool> const& stop)
+{
+  // Wake up now and then to see whether the job is asked to return
+  auto const tick = std::chrono::milliseconds(100);
+
+  auto const until = std::chrono::steady_clock::now() + consume(bytes);
+  for (auto now = std::chrono::steady_clock::now(); now < until; now = std::chrono::steady_clock::now())
+  {
+    if (stop)
+      return false;
+    std::this_thread::sleep_for(std::min<std::chrono::steady_clock::duration>(until - now, tick));
+  }
+  if (!pacer_->config().egress_rate)
+    return !stop;
+
+  // The grant is posted to the socket's executor, which may stop
+  // running before it comes: the promise outlives this wait
+  auto granted = std::make_shared<std::promise<void>>();
+  auto done = granted->get_future();
+  pacer_->async_acquire(cls, bytes, timer_.get_executor(),
+    [granted]
+    {
+      granted->set_value();
+    });
+  while (!stop)
+    if (done.wait_for(tick) == std::future_status::ready)
+      return true;
+  return false;
+}
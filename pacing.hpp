@@ -0,0 +1,217 @@
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <boost/asio/any_io_executor.hpp>
+#include <boost/asio/io_context.hpp>
+#include <boost/asio/ip/tcp.hpp>
+#include <boost/asio/steady_timer.hpp>
+#include <boost/asio/strand.hpp>
+#include <boost/beast/core/error.hpp>
+#include <boost/beast/core/string.hpp>
+
+namespace beast = boost::beast;         // from <boost/beast.hpp>
+namespace net = boost::asio;            // from <boost/asio.hpp>
+using tcp = boost::asio::ip::tcp;       // from <boost/asio/ip/tcp.hpp>
+
+// Rates are expressed in bytes per second, 0 means unlimited.
+struct pacing_config
+{
+  // Token bucket rate applied to every connection
+  std::uint64_t connection_rate = 0;
+
+  // Token bucket rate shared by all connections of one client IP
+  std::uint64_t client_rate = 0;
+
+  // Total egress capacity shared by the fair scheduler
+  std::uint64_t egress_rate = 0;
+
+  // Also ask the kernel (fq qdisc) to pace each socket at connection_rate
+  bool kernel_pacing = false;
+
+  // Number of bytes written per paced write
+  std::size_t chunk_size = 64 * 1024;
+
+  // Body bytes below this offset count as player start-up bytes
+  std::uint64_t early_bytes = 4 * 1024 * 1024;
+
+  bool
+    enabled() const
+  {
+    return connection_rate || client_rate || egress_rate;
+  }
+};
+
+// Egress traffic classes, in decreasing priority.
+enum class traffic_class
+{
+  live,        // multipart `/stream` frames
+  early_range, // first bytes of a file or range, needed to start playback
+  bulk         // everything else, e.g. download accelerators
+};
+
+// A byte-based token bucket. Thread-safe.
+class token_bucket
+{
+  using clock = std::chrono::steady_clock;
+
+  std::mutex mutex_;
+  double rate_;
+  double burst_;
+  double tokens_;
+  clock::time_point last_;
+
+public:
+  token_bucket(std::uint64_t rate, std::uint64_t burst);
+
+  // Take `bytes` tokens and return how long the caller has to wait
+  // before sending them. The bucket may go into debt, so a large
+  // write is never starved by smaller ones.
+  std::chrono::nanoseconds
+    consume(std::size_t bytes);
+};
+
+// Shares the egress capacity between traffic classes using deficit
+// round robin, so that under contention live frames and early range
+// bytes are granted before bulk downloads.
+class fair_scheduler : public std::enable_shared_from_this<fair_scheduler>
+{
+  using clock = std::chrono::steady_clock;
+
+  struct grant
+  {
+    std::size_t bytes;
+    net::any_io_executor ex;
+    std::function<void()> fn;
+  };
+
+  struct flow
+  {
+    unsigned weight;
+    std::size_t deficit = 0;
+    std::deque<grant> pending;
+  };
+
+  net::strand<net::io_context::executor_type> strand_;
+  net::steady_timer timer_;
+  double rate_;
+  std::size_t quantum_;
+  std::array<flow, 3> flows_;
+  std::size_t cursor_ = 0;
+  bool fresh_ = true;
+  bool waiting_ = false;
+  clock::time_point link_free_;
+
+public:
+  fair_scheduler(net::io_context& ioc, std::uint64_t rate, std::size_t quantum);
+
+  // Ask for permission to send `bytes`. `fn` is posted to `ex`
+  // once the link has capacity for them.
+  void
+    async_acquire(
+      traffic_class cls,
+      std::size_t bytes,
+      net::any_io_executor ex,
+      std::function<void()> fn);
+
+private:
+  void
+    service();
+
+  std::size_t
+    select();
+};
+
+// Owns the pacing state shared by every http_session.
+class egress_pacer
+{
+  pacing_config config_;
+  std::shared_ptr<fair_scheduler> scheduler_;
+  std::mutex mutex_;
+  std::unordered_map<std::string, std::weak_ptr<token_bucket>> clients_;
+
+public:
+  egress_pacer(net::io_context& ioc, pacing_config const& config);
+
+  pacing_config const&
+    config() const
+  {
+    return config_;
+  }
+
+  // Returns the bucket shared by every connection from `address`,
+  // or nullptr when per-client limits are disabled.
+  std::shared_ptr<token_bucket>
+    client_bucket(std::string const& address);
+
+  // Returns a new per-connection bucket, or nullptr when disabled.
+  std::unique_ptr<token_bucket>
+    connection_bucket() const;
+
+  // Apply SO_MAX_PACING_RATE to the socket when requested
+  void
+    apply_socket_options(tcp::socket& socket) const;
+
+  // Pick the traffic class of a response body byte
+  traffic_class
+    classify(beast::string_view content_type, std::uint64_t offset) const;
+
+  // Wait for the link, or grant immediately if no egress rate is set
+  void
+    async_acquire(
+      traffic_class cls,
+      std::size_t bytes,
+      net::any_io_executor ex,
+      std::function<void()> fn);
+};
+
+// The pacing of one connection: its token bucket, the bucket of its
+// client IP and the fair scheduler of the egress_pacer.
+class connection_pacer
+{
+  std::shared_ptr<egress_pacer> pacer_;
+  std::shared_ptr<token_bucket> client_bucket_;
+  std::unique_ptr<token_bucket> connection_bucket_;
+  net::steady_timer timer_;
+
+public:
+  // Sets up the socket as configured, the timer runs on its executor
+  connection_pacer(std::shared_ptr<egress_pacer> pacer, tcp::socket& socket);
+
+  pacing_config const&
+    config() const
+  {
+    return pacer_->config();
+  }
+
+  traffic_class
+    classify(beast::string_view content_type, std::uint64_t offset) const
+  {
+    return pacer_->classify(content_type, offset);
+  }
+
+  // Wait until the token buckets and the fair scheduler allow
+  // `bytes` to be sent, then post `fn` to the socket's executor.
+  // Called on that executor, `fn` keeps the connection alive.
+  void
+    async_pace(traffic_class cls, std::size_t bytes, std::function<void()> fn);
+
+  // The same, blocking the calling thread: for jobs writing to the
+  // socket from their own thread. Returns `false` if `stop` was set
+  // before the bytes were allowed.
+  bool
+    pace(traffic_class cls, std::size_t bytes, std::atomic<bool> const& stop);
+
+private:
+  // Take the bytes from both buckets, returns how long to wait for them
+  std::chrono::nanoseconds
+    consume(std::size_t bytes);
+};
@@ -0,0 +1,136 @@
+#pragma once
+
+#include <array>
+#include <cstdint>
+#include <string_view>
+#include <type_traits>
+#include <boost/beast/http/verb.hpp>
+
+// Bit of an HTTP method inside a route's method mask
+constexpr std::uint64_t
+method_bit(boost::beast::http::verb v)
+{
+  return std::uint64_t{ 1 } << static_cast<unsigned>(v);
+}
+
+// Identifies a route type when visiting the table
+template <class Route>
+struct route_tag
+{
+  using type = Route;
+};
+
+// A trie over the ASCII bytes of the route paths, built at compile time.
+// Every node has a full 128 entry transition row so matching a path costs
+// one table lookup per byte, whatever the number of routes.
+template <std::size_t MaxNodes>
+class route_trie
+{
+  static_assert(MaxNodes < 0xffff, "route table too large");
+
+  // next_[n][c] is the child of node n for byte c, 0 if none
+  std::array<std::array<std::uint16_t, 128>, MaxNodes> next_{};
+
+  // Route index + 1 of a route ending at the node, 0 if none
+  std::array<std::uint8_t, MaxNodes> exact_{};
+  std::array<std::uint8_t, MaxNodes> prefix_{};
+  std::size_t size_ = 1;
+
+public:
+  constexpr void
+    insert(std::string_view path, bool is_prefix, std::size_t route)
+  {
+    std::size_t node = 0;
+    for (char c : path)
+    {
+      auto& child = next_[node][static_cast<unsigned char>(c) & 0x7f];
+      if (child == 0)
+        child = static_cast<std::uint16_t>(size_++);
+      node = child;
+    }
+    if (is_prefix)
+      prefix_[node] = static_cast<std::uint8_t>(route + 1);
+    else
+      exact_[node] = static_cast<std::uint8_t>(route + 1);
+  }
+
+  // Returns the index of the exact route for `path`, else of the
+  // longest prefix route, else -1.
+  constexpr int
+    match(std::string_view path) const
+  {
+    int found = -1;
+    std::size_t node = 0;
+    for (char c : path)
+    {
+      if (prefix_[node])
+        found = prefix_[node] - 1;
+      auto const byte = static_cast<unsigned char>(c);
+      if (byte >= 128 || next_[node][byte] == 0)
+        return found;
+      node = next_[node][byte];
+    }
+    if (exact_[node])
+      return exact_[node] - 1;
+    if (prefix_[node])
+      return prefix_[node] - 1;
+    return found;
+  }
+};
+
+// A routing table built from handler types. Each route provides:
+//
+//   static constexpr std::string_view path;   // e.g. "/stream"
+//   static constexpr bool prefix;             // match path and everything below it
+//   static constexpr std::uint64_t methods;   // mask of method_bit()
+//   using body_type = ...;                    // request body the handler needs
+//   static void handle(context, http::request<body_type>&&, Send&&);
+//
+template <class... Routes>
+class router
+{
+  static_assert(sizeof...(Routes) < 0xff, "too many routes");
+
+  static constexpr std::size_t
+    node_count()
+  {
+    return (Routes::path.size() + ... + 1);
+  }
+
+  static constexpr route_trie<node_count()>
+    build()
+  {
+    route_trie<node_count()> trie;
+    std::size_t index = 0;
+    (trie.insert(Routes::path, Routes::prefix, index++), ...);
+    return trie;
+  }
+
+  static constexpr route_trie<node_count()> trie_ = build();
+
+  template <class Visitor, class Route>
+  static void
+    invoke(Visitor& v)
+  {
+    v(route_tag<Route>{});
+  }
+
+public:
+  // Find the route for a request target, ignoring the query string.
+  // Returns -1 if there is none.
+  static constexpr int
+    find(std::string_view target)
+  {
+    return trie_.match(target.substr(0, target.find('?')));
+  }
+
+  // Call `v(route_tag<Route>{})` for the route at `index`
+  template <class Visitor>
+  static void
+    visit(int index, Visitor&& v)
+  {
+    using visitor_type = std::remove_reference_t<Visitor>;
+    static constexpr void (*table[])(visitor_type&) = { &invoke<visitor_type, Routes>... };
+    table[index](v);
+  }
+};
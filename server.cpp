@@ -1,4 +1,15 @@
-#include <future>
+#include <atomic>
+#include <cctype>
+#include <cerrno>
+#include <map>
+#include <thread>
+#include <sys/stat.h>
+#include <boost/beast/core/detail/base64.hpp>
+#include "compression.hpp"
+#include "hpack.hpp"
+#include "http2_frame.hpp"
+#include "live_stream.hpp"
+#include "router.hpp"
 #include "server.hpp"
 
 
@@ -64,6 +75,8 @@ mime_type(beast::string_view path)
     return "image/svg+xml";
   if (iequals(ext, ".mp4"))
     return "video/mp4";
+  if (iequals(ext, ".m3u8"))
+    return "application/vnd.apple.mpegurl";
   return "application/text";
 }
 
@@ -122,156 +135,273 @@ struct fmt::formatter<http::message<isRequest, Body>>
   }
 };
 
+// Send the frames of a live ladder as an MJPEG stream. Frames are
+// written from wherever the hub keeps them, without copying. A viewer
+// gets the renditions from `top` to `bottom`, starting with the best
+// one and moving down while its send queue backs up.
 template <
   class Body, class Allocator,
   class Send>
-void serve_mjpeg_stream(
+void serve_live_stream(
+  std::shared_ptr<live_ladder> const& ladder,
+  std::size_t top,
+  std::size_t bottom,
   const http::request<Body, http::basic_fields<Allocator>>& req,
   Send&& send)
 {
   const std::string boundary = "frame";
-  const std::string gst_cmd =
-    "gst-launch-1.0 -q ximagesrc use-damage=0 ! "
-    "video/x-raw,framerate=120/1 ! videoconvert ! jpegenc ! "
-    "multipartmux boundary=" +
-    boundary + " ! filesink location=/dev/stdout";
 
-  FILE* pipe = popen(gst_cmd.c_str(), "r");
-  if (!pipe)
-  {
-    spdlog::debug("Failed to launch GStreamer MJPEG pipeline.");
-    return;
-  }
-
-  auto sendContinousJPEG = [pipe](beast::tcp_stream& stream)
+  auto sendFrames = [ladder, top, bottom, boundary](
+    beast::tcp_stream& stream, std::atomic<bool> const& stop, connection_pacer* pacer)
     {
-      static int cnt = 0;
-      constexpr int sz = 512 * 1024;
-      std::array<uint8_t, sz> buffer;
+      rendition_selector selector(top, bottom);
+      auto level = selector.level();
+
+      // Keeps the screen capture encoding this rendition while we watch
+      auto viewer = ladder->hub(level).subscribe();
+      std::uint64_t seq = 0;
       boost::system::error_code ec;
-      while (!feof(pipe))
+      while (!stop && !ec)
       {
-        // size_t len = fread(buffer, 1, sizeof(buffer), pipe);
-        size_t len = fread(buffer.data(), 1, buffer.size(), pipe);
-        if (len > 0)
+        auto const f = ladder->hub(level).wait_next(seq, std::chrono::milliseconds(100));
+        if (!f)
+          continue;
+        seq = f->seq;
+
+        auto const part =
+          "--" + boundary + "\r\n"
+          "Content-Type: image/jpeg\r\n"
+          "Content-Length: " + std::to_string(f->size) + "\r\n\r\n";
+        std::array<net::const_buffer, 3> const buffers{
+          net::buffer(part),
+          net::const_buffer(f->data, f->size),
+          net::buffer("\r\n", 2) };
+
+        // Frames are scheduled ahead of the other traffic classes
+        if (pacer && !pacer->pace(traffic_class::live, net::buffer_size(buffers), stop))
+          break;
+        net::write(stream, buffers, ec);
+
+        auto const next = selector.update(send_backlog(stream.socket().native_handle()), f->size);
+        if (next != level)
         {
-          //std::this_thread::sleep_for(std::chrono::milliseconds(5));
-          spdlog::trace("t1 {}", cnt);
-          net::write(stream, net::buffer(buffer), ec);
-          spdlog::trace("t2 {}", cnt++);
-          //std::this_thread::sleep_for(std::chrono::milliseconds(5));
-          if (ec)
-            break;
+          spdlog::debug("Live stream switched to {}", ladder->at(next).name);
+          level = next;
+          viewer = ladder->hub(level).subscribe();
+          seq = 0;
         }
       }
 
-      pclose(pipe);
+      // The server is draining: end the multipart body properly
+      if (stop && !ec)
+        net::write(stream, net::buffer("--" + boundary + "--\r\n"), ec);
     };
 
-  // Send multipart MJPEG headers
   http::response<http::empty_body> res{ http::status::ok, req.version() };
   res.set(http::field::server, BOOST_BEAST_VERSION_STRING);
   res.set(http::field::content_type, "multipart/x-mixed-replace; boundary=" + boundary);
   res.set(http::field::cache_control, "no-cache");
   res.keep_alive(true);
-  return send(std::move(res), std::move(sendContinousJPEG));
+  return send(std::move(res), std::move(sendFrames));
+}
 
+// Returns the value of a query parameter, empty if it is missing
+beast::string_view
+query_param(beast::string_view target, beast::string_view name)
+{
+  auto const question = target.find('?');
+  if (question == beast::string_view::npos)
+    return {};
+  auto query = target.substr(question + 1);
+  while (!query.empty())
+  {
+    auto const amp = query.find('&');
+    auto const item = query.substr(0, amp);
+    if (item.size() > name.size() && item.starts_with(name) && item[name.size()] == '=')
+      return item.substr(name.size() + 1);
+    if (amp == beast::string_view::npos)
+      break;
+    query.remove_prefix(amp + 1);
+  }
+  return {};
+}
+
+// Returns a bad request response
+template <class Body, class Allocator>
+http::response<http::string_body>
+bad_request(
+  http::request<Body, http::basic_fields<Allocator>> const& req,
+  beast::string_view why)
+{
+  http::response<http::string_body> res{ http::status::bad_request, req.version() };
+  res.set(http::field::server, BOOST_BEAST_VERSION_STRING);
+  res.set(http::field::content_type, "text/html");
+  res.keep_alive(req.keep_alive());
+  res.body() = std::string(why);
+  res.prepare_payload();
+  return res;
 }
 
+// Returns a not found response
+template <class Body, class Allocator>
+http::response<http::string_body>
+not_found(
+  http::request<Body, http::basic_fields<Allocator>> const& req,
+  beast::string_view target)
+{
+  http::response<http::string_body> res{ http::status::not_found, req.version() };
+  res.set(http::field::server, BOOST_BEAST_VERSION_STRING);
+  res.set(http::field::content_type, "text/html");
+  res.keep_alive(req.keep_alive());
+  res.body() = "The resource '" + std::string(target) + "' was not found.";
+  res.prepare_payload();
+  return res;
+}
 
-// This function produces an HTTP response for the given
-// request. The type of the response object depends on the
-// contents of the request, so the interface requires the
-// caller to pass a generic lambda for receiving the response.
+// Returns a server error response
+template <class Body, class Allocator>
+http::response<http::string_body>
+server_error(
+  http::request<Body, http::basic_fields<Allocator>> const& req,
+  beast::string_view what)
+{
+  http::response<http::string_body> res{ http::status::internal_server_error, req.version() };
+  res.set(http::field::server, BOOST_BEAST_VERSION_STRING);
+  res.set(http::field::content_type, "text/html");
+  res.keep_alive(req.keep_alive());
+  res.body() = "An error occurred: '" + std::string(what) + "'";
+  res.prepare_payload();
+  return res;
+}
+
+// Everything a route handler may need besides the request
+struct request_context
+{
+  beast::string_view doc_root;
+  compression_cache* compressor;
+  chunk_cache* chunks;
+  std::shared_ptr<live_ladder> live;
+
+  // A pool for the work which would block the I/O threads
+  net::any_io_executor background;
+
+  // Settings of /admin/trace, nullptr when it is disabled
+  trace_config const* tracer;
+
+  // Id of the request when it is traced, else 0
+  std::uint64_t trace = 0;
+};
+
+// Send a compressed representation of a text file when the client
+// accepts one: a precompressed ".br"/".gz" sibling straight from disk,
+// else a cached object. Returns `false` if identity must be sent.
 template <
   class Body, class Allocator,
   class Send>
-void handle_request(
-  beast::string_view doc_root,
-  http::request<Body, http::basic_fields<Allocator>>&& req,
+bool serve_compressed(
+  request_context const& ctx,
+  http::request<Body, http::basic_fields<Allocator>> const& req,
+  std::string const& path,
+  std::string const& etag,
+  std::uint64_t file_size,
   Send&& send)
 {
-  spdlog::info("::handle_request");
-  spdlog::info("{}{}", std::string(2, ' '), req);
-
-  // Returns a bad request response
-  auto const bad_request =
-    [&req](beast::string_view why)
-    {
-      http::response<http::string_body> res{ http::status::bad_request, req.version() };
-      res.set(http::field::server, BOOST_BEAST_VERSION_STRING);
-      res.set(http::field::content_type, "text/html");
-      res.keep_alive(req.keep_alive());
-      res.body() = std::string(why);
-      res.prepare_payload();
-      return res;
-    };
+  auto const accept = req[http::field::accept_encoding];
 
-  // Returns a not found response
-  auto const not_found =
-    [&req](beast::string_view target)
+  auto const respond =
+    [&](auto&& res, content_coding coding, std::uint64_t size)
     {
-      http::response<http::string_body> res{ http::status::not_found, req.version() };
       res.set(http::field::server, BOOST_BEAST_VERSION_STRING);
-      res.set(http::field::content_type, "text/html");
+      res.set(http::field::content_type, mime_type(path));
+      res.set(http::field::content_encoding, coding_name(coding));
+      res.set(http::field::vary, "Accept-Encoding");
+      if (!etag.empty())
+        res.set(http::field::etag,
+          etag.substr(0, etag.size() - 1) + coding_suffix(coding).to_string() + "\"");
+      res.content_length(size);
       res.keep_alive(req.keep_alive());
-      res.body() = "The resource '" + std::string(target) + "' was not found.";
-      res.prepare_payload();
-      return res;
+      send(std::move(res));
+      return true;
     };
 
-  // Returns a server error response
-  auto const server_error =
-    [&req](beast::string_view what)
-    {
-      http::response<http::string_body> res{ http::status::internal_server_error, req.version() };
-      res.set(http::field::server, BOOST_BEAST_VERSION_STRING);
-      res.set(http::field::content_type, "text/html");
-      res.keep_alive(req.keep_alive());
-      res.body() = "An error occurred: '" + std::string(what) + "'";
-      res.prepare_payload();
-      return res;
-    };
-
-  // Make sure we can handle the method
-  if (req.method() != http::verb::get &&
-    req.method() != http::verb::head)
-    return send(bad_request("Unknown HTTP-method"));
-
-  // Request path must be absolute and not contain "..".
-  if (req.target().empty() ||
-    req.target()[0] != '/' ||
-    req.target().find("..") != beast::string_view::npos)
-    return send(bad_request("Illegal request-target"));
-
-
-  if (req.target() == "/stream")
+  // Precompressed siblings
+  unsigned siblings = 0;
+  for (auto coding : { content_coding::br, content_coding::gzip })
   {
-    return serve_mjpeg_stream(req, send);
+    struct stat st;
+    if (::stat((path + coding_suffix(coding).to_string()).c_str(), &st) == 0 && S_ISREG(st.st_mode))
+      siblings |= static_cast<unsigned>(coding);
+  }
+  auto coding = negotiate_coding(accept, siblings);
+  if (coding != content_coding::identity)
+  {
+    beast::error_code ec;
+    http::file_body::value_type body;
+    body.open((path + coding_suffix(coding).to_string()).c_str(), beast::file_mode::scan, ec);
+    if (!ec)
+    {
+      auto const size = body.size();
+      if (req.method() == http::verb::head)
+        return respond(http::response<http::empty_body>{ http::status::ok, req.version() }, coding, size);
+      return respond(
+        http::response<http::file_body>{
+          std::piecewise_construct,
+          std::make_tuple(std::move(body)),
+          std::make_tuple(http::status::ok, req.version()) },
+        coding, size);
+    }
   }
 
-  // Build the path to the requested file
-  std::string path = path_cat(doc_root, req.target());
-  if (req.target().back() == '/')
-    path.append("index.html");
-
-  // Attempt to open the file
-  beast::error_code ec;
-  http::file_body::value_type body;
-  body.open(path.c_str(), beast::file_mode::scan, ec);
+  // Compressed on the background pool, the first requests get identity
+  if (!ctx.compressor || etag.empty())
+    return false;
+  coding = negotiate_coding(accept, compression_cache::codings());
+  if (coding == content_coding::identity)
+    return false;
+  auto const blob = ctx.compressor->find_or_compress(path, etag, file_size, coding);
+  if (!blob || blob->empty())
+    return false;
+  if (req.method() == http::verb::head)
+    return respond(http::response<http::empty_body>{ http::status::ok, req.version() }, coding, blob->size());
+  http::response<shared_string_body> res{ http::status::ok, req.version() };
+  res.body() = blob;
+  return respond(std::move(res), coding, blob->size());
+}
 
+// The response of serve_file once the file was looked at: `body` is
+// open, else the chunk cache knows it as `cached`, unless `ec` is set
+template <
+  class Body, class Allocator,
+  class Send>
+void respond_file(
+  request_context const& ctx,
+  http::request<Body, http::basic_fields<Allocator>>&& req,
+  std::string const& path,
+  http::file_body::value_type&& body,
+  cached_file const& cached,
+  beast::error_code ec,
+  Send&& send)
+{
   // Handle the case where the file doesn't exist
   if (ec == beast::errc::no_such_file_or_directory)
-    return send(not_found(req.target()));
+    return send(not_found(req, req.target()));
 
   // Handle an unknown error
   if (ec)
-    return send(server_error(ec.message()));
+    return send(server_error(req, ec.message()));
 
   // Cache the size since we need it after the move
-  auto const file_size = body.size();
+  auto const file_size = body.is_open() ? body.size() : cached.size;
   spdlog::info("file_size:{:>20}", file_size);
 
+  // Text assets may be sent compressed, unless a range is asked for
+  auto const compressible = is_compressible(mime_type(path));
+  auto const etag = body.is_open() ? entity_tag(path) : cached.etag;
+  if (compressible &&
+    req.base()["Range"].empty() &&
+    serve_compressed(ctx, req, path, etag, file_size, send))
+    return;
+
   //---new-logic---------------------------------------------------------------------
   std::uint64_t start = 0, end = file_size - 1;
   auto range_hdr = req.base()["Range"];
@@ -293,37 +423,74 @@ void handle_request(
     }
   }
 
-  std::uint64_t length = end - start + 1;
-  std::string sbody(length, '\0');
-  spdlog::info("start    :{:>20}", start);
-  spdlog::info("length   :{:>20}", length);
-  body.file().seek(start, ec);
-  // Handle an unknown error
-  if (ec)
-    return send(server_error(ec.message()));
-  body.file().read(static_cast<void*>(&sbody[0]), length, ec);
-  // Handle an unknown error
-  if (ec)
-    return send(server_error(ec.message()));
-  //---new-logic---------------------------------------------------------------------
+  // Read through the chunk cache, one chunk at a time as the body is sent
+  if (ctx.chunks && !etag.empty() && req.method() == http::verb::get && start < file_size)
+  {
+    end = std::min(end, file_size - 1);
+    http::response<cached_file_body> res{
+        partial ? http::status::partial_content : http::status::ok, req.version() };
+    res.set(http::field::server, BOOST_BEAST_VERSION_STRING);
+    res.set(http::field::content_type, mime_type(path));
+    res.set(http::field::etag, etag);
+    if (compressible)
+      res.set(http::field::vary, "Accept-Encoding");
+    res.keep_alive(req.keep_alive());
+    if (partial)
+      res.set(http::field::content_range,
+        "bytes " + std::to_string(start) + "-" + std::to_string(end) + "/" + std::to_string(file_size));
+    res.body() = { ctx.chunks, { path, etag, file_size }, start, end - start + 1 };
+    res.prepare_payload();
+    return send(std::move(res));
+  }
 
-  // Respond to HEAD request
+  // Respond to HEAD request, the file needn't be read
   if (req.method() == http::verb::head)
   {
     http::response<http::empty_body> res{ http::status::ok, req.version() };
     res.set(http::field::server, BOOST_BEAST_VERSION_STRING);
     res.set(http::field::content_type, mime_type(path));
+    if (!etag.empty())
+      res.set(http::field::etag, etag);
+    if (compressible)
+      res.set(http::field::vary, "Accept-Encoding");
     res.content_length(file_size);
     res.keep_alive(req.keep_alive());
     return send(std::move(res));
   }
 
+  if (!body.is_open())
+  {
+    trace_scope trace(ctx.trace, trace_stage::open);
+    body.open(path.c_str(), beast::file_mode::scan, ec);
+    if (ec)
+      return send(server_error(req, ec.message()));
+  }
+
+  std::uint64_t length = end - start + 1;
+  std::string sbody(length, '\0');
+  spdlog::info("start    :{:>20}", start);
+  spdlog::info("length   :{:>20}", length);
+  {
+    trace_scope trace(ctx.trace, trace_stage::read);
+    body.file().seek(start, ec);
+    if (!ec)
+      body.file().read(static_cast<void*>(&sbody[0]), length, ec);
+  }
+  // Handle an unknown error
+  if (ec)
+    return send(server_error(req, ec.message()));
+  //---new-logic---------------------------------------------------------------------
+
   // Respond to GET request
   http::response<http::string_body> res{
       partial ? http::status::partial_content : http::status::ok, req.version() };
   res.set(http::field::server, BOOST_BEAST_VERSION_STRING);
   res.set(http::field::content_type, mime_type(path));
   res.set(http::field::content_length, std::to_string(body.size()));
+  if (!etag.empty())
+    res.set(http::field::etag, etag);
+  if (compressible)
+    res.set(http::field::vary, "Accept-Encoding");
   res.keep_alive(req.keep_alive());
   if (partial)
     res.set(http::field::content_range,
@@ -334,6 +501,225 @@ void handle_request(
   return send(std::move(res));
 }
 
+// Serve a file below doc_root, honoring the Range header.
+template <
+  class Body, class Allocator,
+  class Send>
+void serve_file(
+  request_context const& ctx,
+  http::request<Body, http::basic_fields<Allocator>>&& req,
+  Send&& send)
+{
+  auto const doc_root = ctx.doc_root;
+
+  // Request path must be absolute and not contain "..".
+  if (req.target().find("..") != beast::string_view::npos)
+    return send(bad_request(req, "Illegal request-target"));
+
+  // Build the path to the requested file
+  std::string path = path_cat(doc_root, req.target());
+  if (req.target().back() == '/')
+    path.append("index.html");
+
+  // The chunk cache knows the files it has recently seen. It looks at
+  // the others on its threads, the response is sent once it is done.
+  beast::error_code ec;
+  http::file_body::value_type body;
+  cached_file cached;
+  if (ctx.chunks && !ctx.chunks->lookup(path, cached))
+  {
+    auto const begun = ctx.trace ? trace_now() : 0;
+    ctx.chunks->async_lookup(path,
+      [ctx, req = std::move(req), path, begun, resume = send.defer()](cached_file file, beast::error_code ec) mutable
+      {
+        if (ctx.trace)
+          trace_span(ctx.trace, trace_stage::open, begun, trace_now());
+        resume(
+          [ctx, req = std::move(req), path = std::move(path), file = std::move(file), ec](auto& send) mutable
+          {
+            respond_file(ctx, std::move(req), path, {}, file, ec, send);
+          });
+      });
+    return;
+  }
+  if (!ctx.chunks)
+  {
+    trace_scope trace(ctx.trace, trace_stage::open);
+    body.open(path.c_str(), beast::file_mode::scan, ec);
+  }
+  respond_file(ctx, std::move(req), path, std::move(body), cached, ec, send);
+}
+
+// GET /stream: live MJPEG frames from the screen capture or the shared memory ingest.
+// `?q=<rendition>` fixes the rendition, otherwise it follows the viewer's bandwidth.
+struct stream_route
+{
+  static constexpr std::string_view path = "/stream";
+  static constexpr bool prefix = false;
+  static constexpr std::uint64_t methods =
+    method_bit(http::verb::get) | method_bit(http::verb::head);
+  using body_type = http::empty_body;
+
+  template <class Send>
+  static void
+    handle(request_context const& ctx, http::request<body_type>&& req, Send&& send)
+  {
+    auto const q = query_param(req.target(), "q");
+    if (q.empty() || q == "auto")
+      return serve_live_stream(ctx.live, 0, ctx.live->size() - 1, req, send);
+
+    auto const level = ctx.live->find(std::string_view(q.data(), q.size()));
+    if (level < 0)
+      return send(bad_request(req, "Unknown rendition"));
+    serve_live_stream(ctx.live, level, level, req, send);
+  }
+};
+
+// GET /admin/trace: the spans recorded so far as Chrome trace JSON, to open
+// in Perfetto. POST `?action=start` starts tracing, optionally with
+// `&sample=<n>` to trace one request in n, POST `?action=stop` stops it.
+// Changing the state takes a POST, so that no link, prefetch or
+// crawler following a GET turns tracing on.
+struct trace_route
+{
+  static constexpr std::string_view path = "/admin/trace";
+  static constexpr bool prefix = false;
+  static constexpr std::uint64_t methods =
+    method_bit(http::verb::get) | method_bit(http::verb::post);
+  using body_type = http::empty_body;
+
+  template <class Send>
+  static void
+    handle(request_context const& ctx, http::request<body_type>&& req, Send&& send)
+  {
+    if (!ctx.tracer)
+      return send(not_found(req, req.target()));
+
+    http::response<http::string_body> res{ http::status::ok, req.version() };
+    res.set(http::field::server, BOOST_BEAST_VERSION_STRING);
+    res.set(http::field::content_type, "text/plain");
+    res.set(http::field::cache_control, "no-store");
+    res.keep_alive(req.keep_alive());
+
+    auto const action = query_param(req.target(), "action");
+    if ((req.method() == http::verb::post) == action.empty())
+      return send(bad_request(req, action.empty() ? "Unknown action" : "Use POST to start or stop tracing"));
+
+    if (action == "start")
+    {
+      auto config = *ctx.tracer;
+      auto const sample = query_param(req.target(), "sample");
+      if (!sample.empty())
+      {
+        // A positive count of requests, nothing else
+        auto const digits = sample.to_string();
+        char* end = nullptr;
+        errno = 0;
+        config.sample = std::strtoull(digits.c_str(), &end, 10);
+        if (!std::isdigit(static_cast<unsigned char>(digits[0])) || *end || errno || config.sample == 0)
+          return send(bad_request(req, "sample must be a positive integer"));
+      }
+      start_tracing(config);
+      res.body() = "Tracing 1 in " + std::to_string(config.sample) + " requests\n";
+    }
+    else if (action == "stop")
+    {
+      stop_tracing();
+      res.body() = "Tracing stopped\n";
+    }
+    else if (action.empty())
+    {
+      // Exporting takes a while with large buffers: the JSON is
+      // built on the background pool, then sent by the session
+      res.set(http::field::content_type, "application/json");
+      net::post(ctx.background,
+        [res = std::move(res), resume = send.defer()]() mutable
+        {
+          res.body() = export_trace();
+          res.prepare_payload();
+          resume(
+            [res = std::move(res)](auto& send) mutable
+            {
+              send(std::move(res));
+            });
+        });
+      return;
+    }
+    else
+    {
+      return send(bad_request(req, "Unknown action"));
+    }
+    res.prepare_payload();
+    send(std::move(res));
+  }
+};
+
+// Fallback: files below doc_root
+struct file_route
+{
+  static constexpr std::string_view path = "/";
+  static constexpr bool prefix = true;
+  static constexpr std::uint64_t methods =
+    method_bit(http::verb::get) | method_bit(http::verb::head);
+  using body_type = http::empty_body;
+
+  template <class Send>
+  static void
+    handle(request_context const& ctx, http::request<body_type>&& req, Send&& send)
+  {
+    serve_file(ctx, std::move(req), send);
+  }
+};
+
+using routes = router<
+  stream_route,
+  trace_route,
+  file_route>;
+
+// Give a request the body type a handler expects. The
+// header is moved, a body of another type is dropped.
+template <class To, class From>
+http::request<To>
+with_body(http::request<From>&& req)
+{
+  if constexpr (std::is_same<To, From>::value)
+    return std::move(req);
+  else
+    return http::request<To>(std::move(req.base()));
+}
+
+// This function produces an HTTP response for the given
+// request. The type of the response object depends on the
+// contents of the request, so the interface requires the
+// caller to pass a generic lambda for receiving the response.
+// `route` is the index returned by routes::find for the target.
+template <class Body, class Send>
+void handle_request(
+  int route,
+  request_context const& ctx,
+  http::request<Body>&& req,
+  Send&& send)
+{
+  spdlog::info("::handle_request");
+  spdlog::info("{}{}", std::string(2, ' '), req);
+
+  if (route < 0)
+    return send(bad_request(req, "Illegal request-target"));
+
+  routes::visit(route,
+    [&](auto tag)
+    {
+      using route_type = typename decltype(tag)::type;
+
+      // Make sure the route can handle the method
+      if (!(route_type::methods & method_bit(req.method())))
+        return send(bad_request(req, "Unknown HTTP-method"));
+
+      route_type::handle(ctx,
+        with_body<typename route_type::body_type>(std::move(req)), send);
+    });
+}
+
 //------------------------------------------------------------------------------
 
 // // Report a failure
@@ -355,100 +741,1174 @@ public:
   {
   }
 
-  // Start the asynchronous accept operation
-  template <class Body, class Allocator>
+  // Start the asynchronous accept operation
+  template <class Body, class Allocator>
+  void
+    do_accept(http::request<Body, http::basic_fields<Allocator>> req)
+  {
+    // Set suggested timeout settings for the websocket
+    ws_.set_option(
+      websocket::stream_base::timeout::suggested(
+        beast::role_type::server));
+
+    // Set a decorator to change the Server of the handshake
+    ws_.set_option(websocket::stream_base::decorator(
+      [](websocket::response_type& res)
+      {
+        res.set(http::field::server,
+          std::string(BOOST_BEAST_VERSION_STRING) +
+          " advanced-server");
+      }));
+
+    // Accept the websocket handshake
+    ws_.async_accept(
+      req,
+      beast::bind_front_handler(
+        &websocket_session::on_accept,
+        shared_from_this()));
+  }
+
+private:
+  void
+    on_accept(beast::error_code ec)
+  {
+    if (ec)
+      return fail(ec, "accept");
+
+    // Read a message
+    do_read();
+  }
+
+  void
+    do_read()
+  {
+    // Read a message into our buffer
+    ws_.async_read(
+      buffer_,
+      beast::bind_front_handler(
+        &websocket_session::on_read,
+        shared_from_this()));
+  }
+
+  void
+    on_read(
+      beast::error_code ec,
+      std::size_t bytes_transferred)
+  {
+    boost::ignore_unused(bytes_transferred);
+
+    // This indicates that the websocket_session was closed
+    if (ec == websocket::error::closed)
+      return;
+
+    if (ec)
+      fail(ec, "read");
+
+    // Echo the message
+    ws_.text(ws_.got_text());
+    ws_.async_write(
+      buffer_.data(),
+      beast::bind_front_handler(
+        &websocket_session::on_write,
+        shared_from_this()));
+  }
+
+  void
+    on_write(
+      beast::error_code ec,
+      std::size_t bytes_transferred)
+  {
+    boost::ignore_unused(bytes_transferred);
+
+    if (ec)
+      return fail(ec, "write");
+
+    // Clear the buffer
+    buffer_.consume(buffer_.size());
+
+    // Do another read
+    do_read();
+  }
+};
+
+//------------------------------------------------------------------------------
+
+// Handles an HTTP/2 connection in cleartext (h2c), reached with the
+// prior knowledge preface or through an Upgrade from HTTP/1.1.
+// Requests are multiplexed: responses are cut into DATA frames which
+// are interleaved by priority, so that small requests don't wait
+// behind the bulk bytes of a video.
+class http2_session
+  : public std::enable_shared_from_this<http2_session>
+  , public drainable
+{
+  // Frame types and flags (RFC 9113 section 6)
+  enum : std::uint8_t
+  {
+    frame_data = 0,
+    frame_headers = 1,
+    frame_priority = 2,
+    frame_rst_stream = 3,
+    frame_settings = 4,
+    frame_ping = 6,
+    frame_goaway = 7,
+    frame_window_update = 8,
+    frame_continuation = 9
+  };
+
+  enum : std::uint8_t
+  {
+    flag_end_stream = 0x1,
+    flag_ack = 0x1,
+    flag_end_headers = 0x4,
+    flag_padded = 0x8,
+    flag_priority = 0x20
+  };
+
+  // Error codes (RFC 9113 section 7)
+  enum : std::uint32_t
+  {
+    no_error = 0x0,
+    protocol_error = 0x1,
+    internal_error = 0x2,
+    flow_control_error = 0x3,
+    stream_closed = 0x5,
+    frame_size_error = 0x6,
+    refused_stream = 0x7,
+    cancel = 0x8,
+    compression_error = 0x9,
+    enhance_your_calm = 0xb,
+    http_1_1_required = 0xd
+  };
+
+  // Our settings, the others keep their default value
+  static constexpr std::uint32_t max_frame_size = 16384;
+  static constexpr std::uint32_t max_concurrent_streams = 100;
+
+  // Largest request body and header block we accept
+  static constexpr std::size_t max_body = 10000;
+  static constexpr std::size_t max_header_block = 64 * 1024;
+
+  // DATA bytes gathered into one write. A new response waits
+  // behind at most this much of the responses being sent.
+  static constexpr std::size_t batch_size = 64 * 1024;
+
+  static constexpr std::int64_t max_window = 0x7fffffff;
+
+  // The windows we give the client, the default ones
+  static constexpr std::int64_t window_size = 65535;
+
+  // The body of a response, read into DATA frames
+  struct body_source
+  {
+    virtual ~body_source() = default;
+
+    // Read up to `n` bytes, setting `done` after the last one
+    virtual std::size_t
+      read(std::uint8_t* out, std::size_t n, bool& done, beast::error_code& ec) = 0;
+
+    // When read() returned nothing before the end, call `handler` on
+    // `ex` once there is more to read. Returns `false` if the body
+    // never waits, nothing will come.
+    virtual bool
+      wait(net::any_io_executor ex, std::function<void(beast::error_code)> handler)
+    {
+      boost::ignore_unused(ex, handler);
+      return false;
+    }
+  };
+
+  template <class Body, class Fields>
+  struct message_source : body_source
+  {
+    http::response<Body, Fields> msg_;
+    typename Body::writer writer_;
+    boost::optional<beast::buffers_suffix<typename Body::writer::const_buffers_type>> pending_;
+    bool init_ = false;
+    bool more_ = true;
+    std::uint64_t offset_ = 0;
+    boost::optional<chunk_reader> reader_;
+
+    explicit message_source(http::response<Body, Fields>&& msg)
+      : msg_(std::move(msg)), writer_(msg_.base(), msg_.body())
+    {
+    }
+
+    bool
+      wait(net::any_io_executor ex, std::function<void(beast::error_code)> handler) override
+    {
+      if constexpr (std::is_same<Body, cached_file_body>::value)
+      {
+        reader_->async_fetch(std::move(ex), std::move(handler));
+        return true;
+      }
+      else
+        return body_source::wait(std::move(ex), std::move(handler));
+    }
+
+    std::size_t
+      read(std::uint8_t* out, std::size_t n, bool& done, beast::error_code& ec) override
+    {
+      if constexpr (std::is_same<Body, http::file_body>::value)
+      {
+        // Straight from the file into the frame
+        auto const size = msg_.body().size();
+        auto const got = msg_.body().file().read(out, std::min<std::uint64_t>(n, size - offset_), ec);
+        offset_ += got;
+        done = offset_ >= size;
+        return got;
+      }
+      else if constexpr (std::is_same<Body, cached_file_body>::value)
+      {
+        // The chunks in memory, the others are waited for
+        if (!reader_)
+          reader_.emplace(msg_.body());
+        std::size_t copied = 0;
+        while (copied < n)
+        {
+          auto const data = reader_->data();
+          if (data.size() == 0)
+            break;
+          auto const k = net::buffer_copy(net::buffer(out + copied, n - copied), data);
+          reader_->consume(k);
+          copied += k;
+        }
+        done = reader_->done();
+        return copied;
+      }
+      else
+      {
+        if (!init_)
+        {
+          init_ = true;
+          writer_.init(ec);
+          if (ec)
+            return 0;
+        }
+
+        std::size_t copied = 0;
+        while (copied < n)
+        {
+          if (!pending_ || beast::buffer_bytes(*pending_) == 0)
+          {
+            if (!more_)
+              break;
+            auto result = writer_.get(ec);
+            if (ec)
+              return copied;
+            if (!result)
+            {
+              more_ = false;
+              break;
+            }
+            pending_.emplace(result->first);
+            more_ = result->second;
+          }
+          auto const k = net::buffer_copy(net::buffer(out + copied, n - copied), *pending_);
+          pending_->consume(k);
+          copied += k;
+        }
+        done = !more_ && (!pending_ || beast::buffer_bytes(*pending_) == 0);
+        return copied;
+      }
+    }
+  };
+
+  struct stream
+  {
+    std::vector<hpack::header_field> headers;
+    std::string body;
+    bool remote_closed = false;
+
+    // Flow control windows for our DATA frames and the client's
+    std::int64_t send_window = 65535;
+    std::int64_t recv_window = window_size;
+
+    // RFC 9218 urgency, 0 is the most urgent; `urgency_set` when the
+    // client sent a priority header
+    int urgency = 3;
+    bool urgency_set = false;
+
+    // RFC 7540 weight, shares the link between streams of an urgency
+    unsigned weight = 16;
+    std::uint64_t vtime = 0;
+
+    // Shared with a wait for the body in progress
+    std::shared_ptr<body_source> source;
+    bool waiting = false;
+
+    // For the pacer: the content type of the body and the
+    // offset in the file of its next byte
+    std::string content_type;
+    std::uint64_t offset = 0;
+  };
+
+  // Passed to handle_request as the Send of a stream
+  struct responder
+  {
+    http2_session& self_;
+    std::uint32_t id_;
+
+    template <bool isRequest, class Body, class Fields>
+    void
+      operator()(http::message<isRequest, Body, Fields>&& msg) const
+    {
+      self_.respond(id_, std::move(msg));
+    }
+
+    // Jobs own an HTTP/1.1 connection, the client retries there
+    template <bool isRequest, class Body, class Fields, class Job>
+    void
+      operator()(http::message<isRequest, Body, Fields>&&, Job&&) const
+    {
+      self_.reset_stream(id_, http_1_1_required);
+    }
+
+    // Called by a handler which responds later, see queue::defer.
+    // The response is dropped if the stream was reset meanwhile.
+    std::function<void(std::function<void(responder&)>)>
+      defer() const
+    {
+      return [self = self_.shared_from_this(), id = id_](std::function<void(responder&)> send)
+        {
+          net::post(self->stream_.get_executor(),
+            [self, id, send = std::move(send)]
+            {
+              responder r{ *self, id };
+              send(r);
+              self->do_write();
+            });
+        };
+    }
+  };
+
+  beast::tcp_stream stream_;
+  beast::flat_buffer buffer_;
+  std::shared_ptr<server_state const> state_;
+  hpack::decoder decoder_;
+  hpack::encoder encoder_;
+  std::map<std::uint32_t, stream> streams_;
+
+  // Set when the connection preface was received
+  bool preface_ = false;
+
+  // Stream 1 holds the request of an upgrade, dispatched by run()
+  bool upgraded_ = false;
+
+  // Header block being received in CONTINUATION frames
+  std::uint32_t continuation_id_ = 0;
+  bool continuation_end_stream_ = false;
+  std::string header_block_;
+
+  std::uint32_t last_stream_id_ = 0;
+  std::int64_t send_window_ = 65535;
+  std::int64_t recv_window_ = window_size;
+  std::int64_t initial_window_ = 65535;
+  std::size_t peer_max_frame_ = 16384;
+  std::uint64_t vtime_ = 0;
+
+  // Frames sent before any DATA, then the frames being written
+  std::vector<std::string> control_;
+  std::vector<std::string> writing_;
+  std::vector<net::const_buffer> buffers_;
+
+  // DATA frames wait for the pacer when pacing is enabled
+  std::unique_ptr<connection_pacer> pacer_;
+
+  // DATA bytes the pacer granted and not sent yet
+  std::size_t granted_ = 0;
+  bool pacing_ = false;
+
+  // GOAWAY was sent: no new stream, close once the others are done
+  bool draining_ = false;
+
+  // A connection error: close once GOAWAY is written
+  bool closing_ = false;
+  bool closed_ = false;
+
+public:
+  static constexpr std::string_view preface = "PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n";
+
+  // Take ownership of the socket and of the bytes read so far. With
+  // an upgrade request, it becomes stream 1 once 101 is sent.
+  http2_session(
+    tcp::socket&& socket,
+    std::shared_ptr<server_state const> const& state,
+    beast::flat_buffer&& buffer,
+    boost::optional<http::request<http::empty_body>> upgrade = boost::none)
+    : stream_(std::move(socket)), buffer_(std::move(buffer)), state_(state)
+  {
+    spdlog::debug("http2_session::http2_session() for\t {}", static_cast<void*>(this));
+    if (state_->pacer && state_->pacer->config().enabled())
+      pacer_ = boost::make_unique<connection_pacer>(state_->pacer, stream_.socket());
+
+    if (upgrade)
+    {
+      control_.push_back(
+        "HTTP/1.1 101 Switching Protocols\r\n"
+        "Connection: Upgrade\r\n"
+        "Upgrade: h2c\r\n\r\n");
+    }
+
+    std::string settings;
+    put_setting(settings, 0x3, max_concurrent_streams);
+    queue_frame(frame_settings, 0, 0, settings);
+
+    if (upgrade)
+      on_upgrade(std::move(*upgrade));
+  }
+
+  ~http2_session()
+  {
+    if (state_->sessions)
+      state_->sessions->remove(this);
+  }
+
+  // Start the session
+  void
+    run()
+  {
+    if (state_->sessions)
+      state_->sessions->add(this->shared_from_this());
+    net::dispatch(
+      stream_.get_executor(),
+      [self = this->shared_from_this()]
+      {
+        // The request of the upgrade is answered on stream 1
+        if (self->upgraded_)
+          self->dispatch(1);
+
+        // Frames may have arrived with the preface
+        self->on_read({}, 0);
+      });
+  }
+
+  // Tell the client to stop opening streams, finish the current ones
+  void
+    drain() override
+  {
+    net::dispatch(
+      stream_.get_executor(),
+      [self = this->shared_from_this()]
+      {
+        self->go_away(no_error);
+        self->do_write();
+      });
+  }
+
+private:
+  static void
+    put_u32(std::string& out, std::uint32_t value)
+  {
+    for (int shift = 24; shift >= 0; shift -= 8)
+      out.push_back(static_cast<char>(value >> shift));
+  }
+
+  static void
+    put_setting(std::string& out, std::uint16_t id, std::uint32_t value)
+  {
+    out.push_back(static_cast<char>(id >> 8));
+    out.push_back(static_cast<char>(id));
+    put_u32(out, value);
+  }
+
+  static std::uint32_t
+    get_u32(std::uint8_t const* p)
+  {
+    return std::uint32_t{ p[0] } << 24 | std::uint32_t{ p[1] } << 16 | std::uint32_t{ p[2] } << 8 | p[3];
+  }
+
+  void
+    queue_frame(std::uint8_t type, std::uint8_t flags, std::uint32_t id, beast::string_view payload)
+  {
+    control_.push_back(http2::serialize_frame_header(type, flags, id, payload.size()) + payload.to_string());
+  }
+
+  void
+    reset_stream(std::uint32_t id, std::uint32_t code)
+  {
+    std::string payload;
+    put_u32(payload, code);
+    queue_frame(frame_rst_stream, 0, id, payload);
+    streams_.erase(id);
+  }
+
+  void
+    go_away(std::uint32_t code)
+  {
+    if (draining_ && code == no_error)
+      return;
+    draining_ = true;
+    std::string payload;
+    put_u32(payload, last_stream_id_);
+    put_u32(payload, code);
+    queue_frame(frame_goaway, 0, 0, payload);
+  }
+
+  // A connection error: nothing else is read
+  void
+    connection_error(std::uint32_t code, char const* what)
+  {
+    spdlog::debug("http2_session connection error {}: {}", code, what);
+    go_away(code);
+    closing_ = true;
+  }
+
+  void
+    do_read()
+  {
+    stream_.expires_after(std::chrono::seconds(30));
+    stream_.async_read_some(
+      buffer_.prepare(64 * 1024),
+      beast::bind_front_handler(
+        &http2_session::on_read,
+        shared_from_this()));
+  }
+
+  void
+    on_read(beast::error_code ec, std::size_t bytes_transferred)
+  {
+    if (ec)
+    {
+      if (ec != net::error::eof && ec != net::error::operation_aborted)
+        fail(ec, "read");
+      closed_ = true;
+      return;
+    }
+    buffer_.commit(bytes_transferred);
+
+    if (!preface_)
+    {
+      auto const* data = static_cast<char const*>(buffer_.data().data());
+      auto const size = std::min(buffer_.size(), preface.size());
+      if (std::string_view(data, size) != preface.substr(0, size))
+        return do_close();
+
+      // After an upgrade, 101 and our SETTINGS go out before the preface comes
+      if (buffer_.size() < preface.size())
+      {
+        do_write();
+        return do_read();
+      }
+      buffer_.consume(preface.size());
+      preface_ = true;
+    }
+
+    // Process the complete frames
+    while (!closing_)
+    {
+      auto const* p = static_cast<std::uint8_t const*>(buffer_.data().data());
+      http2::frame_header h;
+      auto const result = http2::parse_frame(p, buffer_.size(), max_frame_size, h);
+      if (result == http2::parse_result::too_large)
+      {
+        connection_error(frame_size_error, "frame too large");
+        break;
+      }
+      if (result == http2::parse_result::incomplete)
+        break;
+      on_frame(h.type, h.flags, h.stream_id, p + http2::frame_header_size, h.length);
+      buffer_.consume(http2::frame_header_size + h.length);
+    }
+
+    do_write();
+    if (!closing_)
+      do_read();
+  }
+
+  void
+    on_frame(std::uint8_t type, std::uint8_t flags, std::uint32_t id, std::uint8_t const* p, std::size_t length)
+  {
+    if (continuation_id_ && (type != frame_continuation || id != continuation_id_))
+      return connection_error(protocol_error, "expected CONTINUATION");
+
+    switch (type)
+    {
+    case frame_data:
+    {
+      if (id == 0)
+        return connection_error(protocol_error, "DATA on stream 0");
+
+      // The whole frame counts against the windows, padding included.
+      // They are given back with the next write, bodies are small.
+      auto const used = static_cast<std::int64_t>(length);
+      if (used > recv_window_)
+        return connection_error(flow_control_error, "connection window exceeded");
+      recv_window_ -= used;
+
+      auto const it = streams_.find(id);
+      if (it == streams_.end() || it->second.remote_closed)
+        return reset_stream(id, stream_closed);
+      auto& s = it->second;
+      if (used > s.recv_window)
+        return reset_stream(id, flow_control_error);
+      s.recv_window -= used;
+      if (!strip_padding(flags, p, length))
+        return connection_error(protocol_error, "bad padding");
+      if (s.body.size() + length > max_body)
+        return reset_stream(id, refused_stream);
+      s.body.append(reinterpret_cast<char const*>(p), length);
+      if (flags & flag_end_stream)
+        return dispatch(id);
+      return;
+    }
+
+    case frame_headers:
+    {
+      if (id == 0 || !(id & 1))
+        return connection_error(protocol_error, "bad stream for HEADERS");
+      if (!strip_padding(flags, p, length))
+        return connection_error(protocol_error, "bad padding");
+      if (flags & flag_priority)
+      {
+        if (length < 5)
+          return connection_error(frame_size_error, "short HEADERS");
+        if (id > last_stream_id_)
+          streams_[id].weight = p[4] + 1u;
+        p += 5;
+        length -= 5;
+      }
+      header_block_.assign(reinterpret_cast<char const*>(p), length);
+      continuation_end_stream_ = flags & flag_end_stream;
+      if (flags & flag_end_headers)
+        return on_header_block(id);
+      continuation_id_ = id;
+      return;
+    }
+
+    case frame_continuation:
+    {
+      if (id != continuation_id_)
+        return connection_error(protocol_error, "unexpected CONTINUATION");
+      if (header_block_.size() + length > max_header_block)
+        return connection_error(enhance_your_calm, "header block too large");
+      header_block_.append(reinterpret_cast<char const*>(p), length);
+      if (flags & flag_end_headers)
+      {
+        continuation_id_ = 0;
+        on_header_block(id);
+      }
+      return;
+    }
+
+    case frame_priority:
+    {
+      if (id == 0 || length != 5)
+        return connection_error(protocol_error, "bad PRIORITY");
+      auto const it = streams_.find(id);
+      if (it != streams_.end())
+        it->second.weight = p[4] + 1u;
+      return;
+    }
+
+    case frame_rst_stream:
+      if (id == 0 || length != 4)
+        return connection_error(protocol_error, "bad RST_STREAM");
+      streams_.erase(id);
+      return;
+
+    case frame_settings:
+      if (id != 0 || length % 6 != 0 || ((flags & flag_ack) && length != 0))
+        return connection_error(protocol_error, "bad SETTINGS");
+      if (flags & flag_ack)
+        return;
+      if (!apply_settings(p, length))
+        return;
+      return queue_frame(frame_settings, flag_ack, 0, {});
+
+    case frame_ping:
+      if (id != 0 || length != 8)
+        return connection_error(protocol_error, "bad PING");
+      if (!(flags & flag_ack))
+        queue_frame(frame_ping, flag_ack, 0, beast::string_view(reinterpret_cast<char const*>(p), length));
+      return;
+
+    case frame_goaway:
+      // The client opens no more streams, we finish the current ones
+      draining_ = true;
+      return;
+
+    case frame_window_update:
+    {
+      if (length != 4)
+        return connection_error(frame_size_error, "bad WINDOW_UPDATE");
+      auto const increment = get_u32(p) & 0x7fffffff;
+      if (id == 0)
+      {
+        if (increment == 0 || send_window_ + increment > max_window)
+          return connection_error(flow_control_error, "bad connection window");
+        send_window_ += increment;
+        return;
+      }
+      auto const it = streams_.find(id);
+      if (it == streams_.end())
+        return;
+      if (increment == 0 || it->second.send_window + increment > max_window)
+        return reset_stream(id, flow_control_error);
+      it->second.send_window += increment;
+      return;
+    }
+
+    default:
+      // Unknown frames are ignored
+      return;
+    }
+  }
+
+  // Remove the padding of a DATA or HEADERS frame
+  static bool
+    strip_padding(std::uint8_t flags, std::uint8_t const*& p, std::size_t& length)
+  {
+    return !(flags & flag_padded) || http2::strip_padding(p, length);
+  }
+
+  bool
+    apply_settings(std::uint8_t const* p, std::size_t length)
+  {
+    for (std::size_t i = 0; i < length; i += 6)
+    {
+      auto const id = static_cast<std::uint16_t>(p[i] << 8 | p[i + 1]);
+      auto const value = get_u32(p + i + 2);
+      switch (id)
+      {
+      case 0x1: // HEADER_TABLE_SIZE
+        encoder_.set_max_table_size(value);
+        break;
+      case 0x4: // INITIAL_WINDOW_SIZE
+      {
+        if (value > max_window)
+        {
+          connection_error(flow_control_error, "bad INITIAL_WINDOW_SIZE");
+          return false;
+        }
+        // No stream window may exceed the maximum once adjusted
+        auto const delta = static_cast<std::int64_t>(value) - initial_window_;
+        for (auto const& s : streams_)
+          if (s.second.send_window + delta > max_window)
+          {
+            connection_error(flow_control_error, "window overflow");
+            return false;
+          }
+        initial_window_ = value;
+        for (auto& s : streams_)
+          s.second.send_window += delta;
+        break;
+      }
+      case 0x5: // MAX_FRAME_SIZE
+        if (value < 16384 || value > 16777215)
+        {
+          connection_error(protocol_error, "bad MAX_FRAME_SIZE");
+          return false;
+        }
+        peer_max_frame_ = value;
+        break;
+      default:
+        break;
+      }
+    }
+    return true;
+  }
+
+  void
+    on_header_block(std::uint32_t id)
+  {
+    std::vector<hpack::header_field> fields;
+    if (!decoder_.decode(
+      reinterpret_cast<std::uint8_t const*>(header_block_.data()), header_block_.size(), fields))
+      return connection_error(compression_error, "bad header block");
+    header_block_.clear();
+
+    auto const it = streams_.find(id);
+    if (id <= last_stream_id_)
+    {
+      // Trailers of a request, or a stream we already closed
+      if (it == streams_.end() || it->second.remote_closed)
+        return reset_stream(id, stream_closed);
+      if (continuation_end_stream_)
+        dispatch(id);
+      return;
+    }
+    last_stream_id_ = id;
+
+    // The stream only exists if HEADERS carried its priority
+    auto const weight = it == streams_.end() ? 16u : it->second.weight;
+    streams_.erase(id);
+    if (draining_ || streams_.size() >= max_concurrent_streams)
+      return reset_stream(id, refused_stream);
+
+    auto& s = streams_[id];
+    s.headers = std::move(fields);
+    s.weight = weight;
+    s.send_window = initial_window_;
+    if (continuation_end_stream_)
+      dispatch(id);
+  }
+
+  // The client sent stream 1 as an HTTP/1.1 request
+  void
+    on_upgrade(http::request<http::empty_body>&& req)
+  {
+    // HTTP2-Settings is a SETTINGS payload in base64url
+    auto settings = req[http::field::http2_settings].to_string();
+    for (auto& c : settings)
+      c = c == '-' ? '+' : c == '_' ? '/' : c;
+    settings.append((4 - settings.size() % 4) % 4, '=');
+    std::string payload(beast::detail::base64::decoded_size(settings.size()), '\0');
+    auto const decoded = beast::detail::base64::decode(&payload[0], settings.data(), settings.size());
+    payload.resize(decoded.first);
+    if (payload.size() % 6 == 0)
+      apply_settings(reinterpret_cast<std::uint8_t const*>(payload.data()), payload.size());
+
+    auto& s = streams_[1];
+    last_stream_id_ = 1;
+    s.send_window = initial_window_;
+    s.headers.push_back({ ":method", req.method_string().to_string() });
+    s.headers.push_back({ ":path", req.target().to_string() });
+    for (auto const& field : req)
+    {
+      auto const name = beast::string_view(field.name_string());
+      if (!beast::iequals(name, "connection") &&
+        !beast::iequals(name, "upgrade") &&
+        !beast::iequals(name, "http2-settings"))
+        s.headers.push_back({ lowercase(name), field.value().to_string() });
+    }
+    upgraded_ = true;
+  }
+
+  static std::string
+    lowercase(beast::string_view s)
+  {
+    std::string out(s.data(), s.size());
+    for (auto& c : out)
+      c = static_cast<char>(std::tolower(static_cast<unsigned char>(c)));
+    return out;
+  }
+
+  // The request of a stream is complete
+  void
+    dispatch(std::uint32_t id)
+  {
+    auto const trace = trace_sample();
+    auto const parsed = trace ? trace_now() : 0;
+    auto& s = streams_.at(id);
+    s.remote_closed = true;
+
+    http::request<http::string_body> req;
+    req.version(11);
+    bool method = false, path = false;
+    std::string cookie;
+    for (auto& f : s.headers)
+    {
+      if (f.name == ":method")
+      {
+        req.method_string(f.value);
+        method = true;
+      }
+      else if (f.name == ":path")
+      {
+        req.target(f.value);
+        path = !f.value.empty();
+      }
+      else if (f.name == ":authority")
+      {
+        if (req[http::field::host].empty())
+          req.set(http::field::host, f.value);
+      }
+      else if (f.name == "cookie")
+      {
+        cookie += (cookie.empty() ? "" : "; ") + f.value;
+      }
+      else if (f.name == "priority")
+      {
+        auto const u = f.value.find("u=");
+        if (u != std::string::npos && u + 2 < f.value.size() && std::isdigit(static_cast<unsigned char>(f.value[u + 2])))
+        {
+          s.urgency = std::min(f.value[u + 2] - '0', 7);
+          s.urgency_set = true;
+        }
+      }
+      else if (!f.name.empty() && f.name[0] != ':')
+      {
+        req.insert(f.name, f.value);
+      }
+    }
+    if (!method || !path)
+      return reset_stream(id, protocol_error);
+    if (!cookie.empty())
+      req.set(http::field::cookie, cookie);
+    if (!s.body.empty())
+    {
+      req.body() = std::move(s.body);
+      req.prepare_payload();
+    }
+    s.headers.clear();
+    s.headers.shrink_to_fit();
+
+    auto const target = req.target();
+    auto const route = routes::find({ target.data(), target.size() });
+    if (trace)
+      trace_span(trace, trace_stage::parse, parsed, trace_now());
+    handle_request(
+      route,
+      request_context{ state_->doc_root, state_->compressor.get(), state_->chunks.get(), state_->live, state_->background, state_->tracer.get(), trace },
+      std::move(req),
+      responder{ *this, id });
+  }
+
+  template <class Body, class Fields>
   void
-    do_accept(http::request<Body, http::basic_fields<Allocator>> req)
+    respond(std::uint32_t id, http::message<false, Body, Fields>&& msg)
   {
-    // Set suggested timeout settings for the websocket
-    ws_.set_option(
-      websocket::stream_base::timeout::suggested(
-        beast::role_type::server));
+    spdlog::info("{}{}", std::string(2, ' '), msg);
 
-    // Set a decorator to change the Server of the handshake
-    ws_.set_option(websocket::stream_base::decorator(
-      [](websocket::response_type& res)
-      {
-        res.set(http::field::server,
-          std::string(BOOST_BEAST_VERSION_STRING) +
-          " advanced-server");
-      }));
+    auto const it = streams_.find(id);
+    if (it == streams_.end())
+      return;
+    auto& s = it->second;
 
-    // Accept the websocket handshake
-    ws_.async_accept(
-      req,
-      beast::bind_front_handler(
-        &websocket_session::on_accept,
-        shared_from_this()));
+    std::vector<hpack::header_field> fields;
+    fields.push_back({ ":status", std::to_string(msg.result_int()) });
+    for (auto const& field : msg)
+    {
+      auto const name = lowercase(field.name_string());
+      if (name == "connection" || name == "keep-alive" || name == "proxy-connection" ||
+        name == "transfer-encoding" || name == "upgrade")
+        continue;
+      fields.push_back({ name, field.value().to_string() });
+    }
+
+    // Video bytes go after pages, manifests and thumbnails
+    // unless the client asked otherwise
+    if (!s.urgency_set && msg[http::field::content_type].starts_with("video/"))
+      s.urgency = 4;
+
+    auto const payload = msg.payload_size();
+    bool const empty = payload && *payload == 0;
+    queue_headers(id, encoder_.encode(fields), empty);
+    if (empty)
+    {
+      streams_.erase(it);
+      return;
+    }
+    s.vtime = vtime_;
+    if (pacer_)
+    {
+      // A partial response starts at the first byte of its range
+      s.content_type = msg[http::field::content_type].to_string();
+      auto const range = msg[http::field::content_range];
+      if (range.starts_with("bytes "))
+        s.offset = std::strtoull(range.substr(6).to_string().c_str(), nullptr, 10);
+    }
+    s.source = std::make_shared<message_source<Body, Fields>>(std::move(msg));
   }
 
-private:
+  // HEADERS, then CONTINUATION frames if the block is larger than a frame
   void
-    on_accept(beast::error_code ec)
+    queue_headers(std::uint32_t id, std::string const& block, bool end_stream)
   {
-    if (ec)
-      return fail(ec, "accept");
+    std::size_t pos = 0;
+    do
+    {
+      auto const n = std::min(block.size() - pos, peer_max_frame_);
+      std::uint8_t flags = pos + n == block.size() ? flag_end_headers : 0;
+      if (pos == 0 && end_stream)
+        flags |= flag_end_stream;
+      queue_frame(pos == 0 ? frame_headers : frame_continuation, flags, id,
+        beast::string_view(block).substr(pos, n));
+      pos += n;
+    } while (pos < block.size());
+  }
 
-    // Read a message
-    do_read();
+  // The stream which sends next: the most urgent one, then
+  // the one which received the least data for its weight
+  stream*
+    next_stream(std::uint32_t& id)
+  {
+    stream* best = nullptr;
+    for (auto& entry : streams_)
+    {
+      auto& s = entry.second;
+      if (!s.source || s.waiting || s.send_window <= 0)
+        continue;
+      if (!best || s.urgency < best->urgency || (s.urgency == best->urgency && s.vtime < best->vtime))
+      {
+        best = &s;
+        id = entry.first;
+      }
+    }
+    return best;
   }
 
+  // Give back the receive windows used by the DATA received
   void
-    do_read()
+    update_windows()
   {
-    // Read a message into our buffer
-    ws_.async_read(
-      buffer_,
-      beast::bind_front_handler(
-        &websocket_session::on_read,
-        shared_from_this()));
+    std::string increment;
+    if (recv_window_ < window_size)
+    {
+      put_u32(increment, static_cast<std::uint32_t>(window_size - recv_window_));
+      queue_frame(frame_window_update, 0, 0, increment);
+      recv_window_ = window_size;
+    }
+    for (auto& entry : streams_)
+    {
+      auto& s = entry.second;
+      if (s.remote_closed || s.recv_window >= window_size)
+        continue;
+      increment.clear();
+      put_u32(increment, static_cast<std::uint32_t>(window_size - s.recv_window));
+      queue_frame(frame_window_update, 0, entry.first, increment);
+      s.recv_window = window_size;
+    }
   }
 
   void
-    on_read(
-      beast::error_code ec,
-      std::size_t bytes_transferred)
+    do_write()
   {
-    boost::ignore_unused(bytes_transferred);
-
-    // This indicates that the websocket_session was closed
-    if (ec == websocket::error::closed)
+    if (!writing_.empty() || closed_)
       return;
 
-    if (ec)
-      fail(ec, "read");
+    update_windows();
+    writing_ = std::move(control_);
+    control_.clear();
+
+    // Interleave DATA frames within the flow control windows and what
+    // the pacer granted. After an upgrade they wait for the preface and
+    // the client's SETTINGS.
+    std::size_t budget = closing_ || !preface_ ? 0 : batch_size;
+    if (pacer_)
+      budget = std::min(budget, granted_);
+    while (budget > 0 && send_window_ > 0)
+    {
+      std::uint32_t id = 0;
+      auto* s = next_stream(id);
+      if (!s)
+        break;
+
+      auto const n = static_cast<std::size_t>(std::min<std::int64_t>(
+        { static_cast<std::int64_t>(std::min(peer_max_frame_, budget)), s->send_window, send_window_ }));
+      std::string frame(9 + n, '\0');
+      bool done = false;
+      beast::error_code ec;
+      auto const got = s->source->read(reinterpret_cast<std::uint8_t*>(&frame[9]), n, done, ec);
+
+      // The next bytes are being read, the other streams send meanwhile
+      if (!ec && got == 0 && !done && s->source->wait(stream_.get_executor(),
+        [this, self = shared_from_this(), id, source = s->source](beast::error_code ec)
+        {
+          auto const it = streams_.find(id);
+          if (it == streams_.end() || it->second.source != source)
+            return;
+          it->second.waiting = false;
+          if (ec)
+          {
+            fail(ec, "http2 body");
+            reset_stream(id, internal_error);
+          }
+          do_write();
+        }))
+      {
+        s->waiting = true;
+        continue;
+      }
+      if (ec || (got == 0 && !done))
+      {
+        fail(ec, "http2 body");
+        reset_stream(id, internal_error);
+        continue;
+      }
+      frame.resize(9 + got);
+      frame.replace(0, 9, http2::serialize_frame_header(frame_data, done ? flag_end_stream : 0, id, got));
+      writing_.push_back(std::move(frame));
+
+      s->send_window -= got;
+      send_window_ -= got;
+      s->offset += got;
+      budget -= std::min(budget, got);
+      if (pacer_)
+        granted_ -= std::min(granted_, got);
+      vtime_ = s->vtime;
+      s->vtime += (got + 1) * 256 / s->weight;
+      if (done)
+        streams_.erase(id);
+    }
 
-    // Echo the message
-    ws_.text(ws_.got_text());
-    ws_.async_write(
-      buffer_.data(),
+    // Move RST_STREAM frames queued above into this write
+    for (auto& f : control_)
+      writing_.push_back(std::move(f));
+    control_.clear();
+
+    // Ask the pacer for the next DATA frames, for the class of the
+    // stream which sends next
+    if (pacer_ && granted_ == 0 && !pacing_ && !closing_ && preface_ && send_window_ > 0)
+    {
+      std::uint32_t id = 0;
+      if (auto const* s = next_stream(id))
+      {
+        pacing_ = true;
+        auto const chunk = pacer_->config().chunk_size;
+        pacer_->async_pace(pacer_->classify(s->content_type, s->offset), chunk,
+          [this, self = shared_from_this(), chunk]
+          {
+            pacing_ = false;
+            granted_ = chunk;
+            do_write();
+          });
+      }
+    }
+
+    if (writing_.empty())
+    {
+      if (closing_ || (draining_ && streams_.empty()))
+        do_close();
+      return;
+    }
+
+    buffers_.clear();
+    for (auto const& f : writing_)
+      buffers_.push_back(net::buffer(f));
+    stream_.expires_after(std::chrono::seconds(30));
+    net::async_write(
+      stream_,
+      buffers_,
       beast::bind_front_handler(
-        &websocket_session::on_write,
+        &http2_session::on_write,
         shared_from_this()));
   }
 
   void
-    on_write(
-      beast::error_code ec,
-      std::size_t bytes_transferred)
+    on_write(beast::error_code ec, std::size_t bytes_transferred)
   {
     boost::ignore_unused(bytes_transferred);
-
+    writing_.clear();
     if (ec)
+    {
+      closed_ = true;
       return fail(ec, "write");
+    }
+    do_write();
+  }
 
-    // Clear the buffer
-    buffer_.consume(buffer_.size());
+  void
+    do_close()
+  {
+    if (closed_)
+      return;
+    closed_ = true;
+    spdlog::debug("http2_session::do_close() for\t {}", static_cast<void*>(this));
 
-    // Do another read
-    do_read();
+    // Send a TCP shutdown, the pending read ends with the client's
+    beast::error_code ec;
+    stream_.socket().shutdown(tcp::socket::shutdown_send, ec);
   }
 };
 
 //------------------------------------------------------------------------------
 
 // Handles an HTTP server connection
-class http_session : public std::enable_shared_from_this<http_session>
+class http_session
+  : public std::enable_shared_from_this<http_session>
+  , public drainable
 {
   // This queue is used for HTTP pipelining.
   class queue
@@ -498,9 +1958,37 @@ class http_session : public std::enable_shared_from_this<http_session>
       return was_full;
     }
 
+    // Returns `true` if no response is pending
+    bool
+      empty() const
+    {
+      return items_.empty();
+    }
+
+    // Called by a handler which responds later, e.g. once a pool thread
+    // is done. The returned function is called once, from any thread,
+    // with the function sending the response, which runs on the session.
+    // No other request is read meanwhile so the responses stay in order.
+    std::function<void(std::function<void(queue&)>)>
+      defer()
+    {
+      ++self_.deferred_;
+      return [self = self_.shared_from_this(), trace = self_.trace_](std::function<void(queue&)> send)
+        {
+          net::post(self->stream_.get_executor(),
+            [self, trace, send = std::move(send)]
+            {
+              self->on_resume(trace, send);
+            });
+        };
+    }
+
+    // A job writes the body of a response after its header was sent,
+    // owning the connection until it returns or `stop` is set. When
+    // pacing is enabled, it waits for `pacer` before its writes.
     struct empty_job
     {
-      void operator()(beast::tcp_stream&) {
+      void operator()(beast::tcp_stream&, std::atomic<bool> const&, connection_pacer*) {
       }
     };
 
@@ -515,33 +2003,174 @@ class http_session : public std::enable_shared_from_this<http_session>
         http_session& self_;
         http::message<isRequest, Body, Fields> msg_;
         Job j;
+        http::serializer<isRequest, Body, Fields> sr_;
+        std::uint64_t offset_ = 0;
+        std::size_t written_ = 0;
+        std::uint64_t trace_;
+        std::uint64_t queued_;
+        std::uint64_t started_ = 0;
 
         work_impl(
           http_session& self,
           http::message<isRequest, Body, Fields>&& msg,
           Job&& job)
-          : self_(self), msg_(std::move(msg)), j(std::move(job))
+          : self_(self), msg_(std::move(msg)), j(std::move(job)), sr_(msg_)
+          , trace_(self.trace_), queued_(trace_ ? trace_now() : 0)
         {
+          // A partial response starts at the first byte of its range
+          auto const range = msg_[http::field::content_range];
+          if (range.starts_with("bytes "))
+            offset_ = std::strtoull(range.substr(6).to_string().c_str(), nullptr, 10);
+
+          // The header goes out before the first chunk is waited for
+          if constexpr (std::is_same<Body, cached_file_body>::value)
+            sr_.split(true);
         }
 
         void
           operator()()
         {
           spdlog::info("{}{}", std::string(2, ' '), msg_);
-          http::async_write(
+
+          if (trace_)
+          {
+            started_ = trace_now();
+            trace_span(trace_, trace_stage::queue, queued_, started_);
+          }
+
+          // Tell the client this is the last response
+          if (self_.draining_)
+            msg_.keep_alive(false);
+
+          if (self_.pacer_)
+            do_paced_write();
+          else if constexpr (std::is_same<Body, cached_file_body>::value)
+            do_write();
+          else
+            http::async_write(
+              self_.stream_,
+              msg_,
+              [this, self = self_.shared_from_this()](beast::error_code ec, std::size_t bytes_transferred)
+              {
+                on_sent(ec, bytes_transferred);
+              });
+        }
+
+        // Write the message piece by piece, the body stops
+        // at each chunk missing from memory
+        void
+          do_write()
+        {
+          http::async_write_some(
             self_.stream_,
-            msg_,
-            beast::bind_front_handler(
-              &http_session::on_write,
-              self_.shared_from_this(),
-              msg_.need_eof()));
-
-          auto fut = std::async(std::launch::async,
-                std::move(j), std::ref(self_.stream_));
-          //j(self_.stream_);
+            sr_,
+            [this, self = self_.shared_from_this()](beast::error_code ec, std::size_t bytes_transferred)
+            {
+              written_ += bytes_transferred;
+              if (ec == http::error::need_more)
+                return fetch([this] { do_write(); });
+              if (ec || sr_.is_done())
+                return on_sent(ec, written_);
+              do_write();
+            });
+        }
+
+        // The body waits for bytes read on another thread,
+        // `next` continues the write once they are there
+        void
+          fetch(std::function<void()> next)
+        {
+          if constexpr (std::is_same<Body, cached_file_body>::value)
+            sr_.writer_impl().async_fetch(
+              self_.stream_.get_executor(),
+              [this, self = self_.shared_from_this(), next = std::move(next)](beast::error_code ec)
+              {
+                if (ec)
+                  return on_sent(ec, written_);
+                next();
+              });
+          else
+            on_sent(http::error::need_more, written_);
+        }
+
+        // Called when the message was written
+        void
+          on_sent(beast::error_code ec, std::size_t bytes_transferred)
+        {
+          if (trace_)
+            trace_span(trace_, trace_stage::write, started_, trace_now());
+
+          if constexpr (std::is_same<Job, empty_job>::value)
+          {
+            self_.on_write(msg_.need_eof(), ec, bytes_transferred);
+          }
+          else
+          {
+            if (ec)
+              return self_.on_write(true, ec, bytes_transferred);
+
+            // Run the job on its own thread, the connection is closed
+            // once it returns. The thread isn't owned by the session, so
+            // its reference to the session ends with the job. Nothing
+            // else uses the socket meanwhile, it has no timeout.
+            self_.stream_.expires_never();
+            auto running = self_.state_->sessions
+              ? self_.state_->sessions->start_job()
+              : nullptr;
+            std::thread(
+              [this, self = self_.shared_from_this(), running = std::move(running)]() mutable
+              {
+                j(self_.stream_, self_.stopping_, self_.pacer_.get());
+                net::post(
+                  self_.stream_.get_executor(),
+                  [this, self = std::move(self)]
+                  {
+                    self_.on_write(true, {}, 0);
+                  });
+                running.reset();
+              }).detach();
+          }
+        }
+
+        // Write the message one chunk at a time, waiting
+        // for the pacer before each chunk.
+        void
+          do_paced_write()
+        {
+          auto const chunk = self_.pacer_->config().chunk_size;
+          auto const cls = self_.pacer_->classify(
+            msg_[http::field::content_type], offset_ + written_);
+          self_.pacer_->async_pace(cls, chunk,
+            [this, self = self_.shared_from_this(), chunk]
+            {
+              sr_.limit(chunk);
+              write_chunk();
+            });
+        }
+
+        void
+          write_chunk()
+        {
+          http::async_write_some(
+            self_.stream_,
+            sr_,
+            [this, self = self_.shared_from_this()](beast::error_code ec, std::size_t bytes_transferred)
+            {
+              written_ += bytes_transferred;
+              // The pacer already granted this chunk
+              if (ec == http::error::need_more)
+                return fetch([this] { write_chunk(); });
+              if (ec || sr_.is_done())
+                return on_sent(ec, written_);
+              do_paced_write();
+            });
         }
       };
 
+      // The job will own the socket, no other request is read
+      if constexpr (!std::is_same<Job, empty_job>::value)
+        self_.job_ = true;
+
       // Allocate and store the work
       items_.push_back(
         boost::make_unique<work_impl>(self_, std::move(msg), std::move(job)));
@@ -555,21 +2184,48 @@ class http_session : public std::enable_shared_from_this<http_session>
 
   beast::tcp_stream stream_;
   beast::flat_buffer buffer_;
-  std::shared_ptr<std::string const> doc_root_;
+  std::shared_ptr<server_state const> state_;
+  std::unique_ptr<connection_pacer> pacer_;
   queue queue_;
 
   // The parser is stored in an optional container so we can
-  // construct it from scratch it at the beginning of each new message.
-  boost::optional<http::request_parser<http::string_body>> parser_;
+  // construct it from scratch at the beginning of each new message.
+  // It reads the header; when a body follows, a parser for the body
+  // type of the route takes over.
+  boost::optional<http::request_parser<http::empty_body>> parser_;
+
+  // Index of the route matching the current request
+  int route_ = -1;
+
+  // Set when the server drains: finish the queued
+  // responses, then close instead of reading again.
+  bool draining_ = false;
+
+  // Asks running jobs (live streams) to return
+  std::atomic<bool> stopping_{ false };
+
+  // Set once a response with a job is queued: the job writes to the
+  // socket from its thread until the connection closes, so nothing
+  // is read from it anymore
+  bool job_ = false;
+
+  // Responses a handler will send later, see queue::defer
+  int deferred_ = 0;
+
+  // Id of the request being read when it is traced, and when its stage began
+  std::uint64_t trace_ = 0;
+  std::uint64_t stage_begin_ = 0;
 
 public:
   // Take ownership of the socket
   http_session(
     tcp::socket&& socket,
-    std::shared_ptr<std::string const> const& doc_root)
-    : stream_(std::move(socket)), doc_root_(doc_root), queue_(*this)
+    std::shared_ptr<server_state const> const& state)
+    : stream_(std::move(socket)), state_(state), queue_(*this)
   {
     spdlog::debug("http_session::http_session() for\t {}", static_cast<void*>(this));
+    if (state_->pacer && state_->pacer->config().enabled())
+      pacer_ = boost::make_unique<connection_pacer>(state_->pacer, stream_.socket());
   }
 
   // Start the session
@@ -580,44 +2236,168 @@ public:
     // on the I/O objects in this session. Although not strictly necessary
     // for single-threaded contexts, this example code is written to be
     // thread-safe by default.
+    if (state_->sessions)
+      state_->sessions->add(this->shared_from_this());
     net::dispatch(
       stream_.get_executor(),
       beast::bind_front_handler(
-        &http_session::do_read,
+        &http_session::do_detect,
         this->shared_from_this()));
   }
 
+  // Start the session, tracing its first request from the
+  // accept of the connection on when `trace` is set
+  void
+    run(std::uint64_t trace, std::uint64_t accepted)
+  {
+    if (trace)
+    {
+      trace_ = trace;
+      stage_begin_ = trace_now();
+      trace_span(trace_, trace_stage::accept, accepted, stage_begin_);
+    }
+    run();
+  }
+
+  ~http_session()
+  {
+    if (state_->sessions)
+      state_->sessions->remove(this);
+  }
+
+  // Finish the current responses, then close the connection
+  void
+    drain() override
+  {
+    stopping_ = true;
+    net::dispatch(
+      stream_.get_executor(),
+      [self = this->shared_from_this()]
+      {
+        self->draining_ = true;
+
+        // Nothing is being sent, so we are waiting for a request
+        if (self->queue_.empty())
+          self->stream_.cancel();
+      });
+  }
+
+  void
+    stop_jobs() override
+  {
+    stopping_ = true;
+  }
+
 private:
+  // Read until the first bytes tell whether they start
+  // the connection preface of HTTP/2 with prior knowledge
+  void
+    do_detect()
+  {
+    if (trace_ && stage_begin_)
+    {
+      trace_span(trace_, trace_stage::dispatch, stage_begin_, trace_now());
+      stage_begin_ = 0;
+    }
+
+    stream_.expires_after(std::chrono::seconds(30));
+    stream_.async_read_some(
+      buffer_.prepare(1024),
+      beast::bind_front_handler(
+        &http_session::on_detect,
+        shared_from_this()));
+  }
+
+  void
+    on_detect(beast::error_code ec, std::size_t bytes_transferred)
+  {
+    if (ec == net::error::eof ||
+      (ec == net::error::operation_aborted && draining_))
+      return do_close();
+
+    if (ec)
+      return fail(ec, "read");
+
+    buffer_.commit(bytes_transferred);
+    auto const* data = static_cast<char const*>(buffer_.data().data());
+    auto const size = std::min(buffer_.size(), http2_session::preface.size());
+    if (std::string_view(data, size) != http2_session::preface.substr(0, size))
+      return do_read();
+    if (size < http2_session::preface.size())
+      return do_detect();
+
+    std::make_shared<http2_session>(
+      stream_.release_socket(),
+      state_,
+      std::move(buffer_))
+      ->run();
+  }
+
   void
     do_read()
   {
-    // Construct a new parser for each message
+    // Construct a new parser for each message. Only the header
+    // is read first, the body is parsed once we know it is needed.
     parser_.emplace();
 
-    // Apply a reasonable limit to the allowed size
-    // of the body in bytes to prevent abuse.
-    parser_->body_limit(10000);
-
     // Set the timeout.
     stream_.expires_after(std::chrono::seconds(30));
 
-    // Read a request using the parser-oriented interface
-    http::async_read(
+    // A traced request is parsed from its first bytes on, the
+    // wait for them is idle time of the connection
+    if (!trace_)
+      trace_ = trace_sample();
+    if (trace_ && buffer_.size() == 0)
+    {
+      stream_.async_read_some(
+        buffer_.prepare(1024),
+        beast::bind_front_handler(
+          &http_session::on_first_bytes,
+          shared_from_this()));
+      return;
+    }
+    if (trace_)
+      stage_begin_ = trace_now();
+    do_read_header();
+  }
+
+  void
+    on_first_bytes(beast::error_code ec, std::size_t bytes_transferred)
+  {
+    if (ec == net::error::eof ||
+      (ec == net::error::operation_aborted && draining_))
+      return do_close();
+
+    if (ec)
+      return fail(ec, "read");
+
+    buffer_.commit(bytes_transferred);
+    stage_begin_ = trace_now();
+    do_read_header();
+  }
+
+  void
+    do_read_header()
+  {
+    // Read a request header using the parser-oriented interface
+    http::async_read_header(
       stream_,
       buffer_,
       *parser_,
       beast::bind_front_handler(
-        &http_session::on_read,
+        &http_session::on_read_header,
         shared_from_this()));
   }
 
   void
-    on_read(beast::error_code ec, std::size_t bytes_transferred)
+    on_read_header(beast::error_code ec, std::size_t bytes_transferred)
   {
     boost::ignore_unused(bytes_transferred);
 
-    // This means they closed the connection
-    if (ec == http::error::end_of_stream)
+    // This means they closed the connection,
+    // or that we stopped waiting because of a drain.
+    if (ec == http::error::end_of_stream ||
+      (ec == net::error::operation_aborted && draining_))
       return do_close();
 
     if (ec)
@@ -634,11 +2414,101 @@ private:
       return;
     }
 
+    // See if it is an HTTP/2 Upgrade. Requests with a body
+    // and pipelined ones stay with HTTP/1.1.
+    if (parser_->is_done() &&
+      queue_.empty() &&
+      !draining_ &&
+      http::token_list{ parser_->get()[http::field::upgrade] }.exists("h2c") &&
+      parser_->get().count(http::field::http2_settings))
+    {
+      std::make_shared<http2_session>(
+        stream_.release_socket(),
+        state_,
+        std::move(buffer_),
+        parser_->release())
+        ->run();
+      return;
+    }
+
+    auto const target = parser_->get().target();
+    route_ = routes::find({ target.data(), target.size() });
+
+    // Requests without a body are dispatched straight away
+    if (parser_->is_done())
+      return on_request(parser_->release());
+
+    // Otherwise the body is read into the body type of the route
+    if (route_ < 0)
+      return reject_body();
+    routes::visit(route_,
+      [&](auto tag)
+      {
+        using body_type = typename decltype(tag)::type::body_type;
+        if constexpr (std::is_same<body_type, http::empty_body>::value)
+          reject_body();
+        else
+          read_body<body_type>();
+      });
+  }
+
+  template <class Body>
+  void
+    read_body()
+  {
+    auto parser = std::make_shared<http::request_parser<Body>>(std::move(*parser_));
+
+    // Apply a reasonable limit to the allowed size
+    // of the body in bytes to prevent abuse.
+    parser->body_limit(10000);
+
+    http::async_read(
+      stream_,
+      buffer_,
+      *parser,
+      [self = shared_from_this(), parser](beast::error_code ec, std::size_t)
+      {
+        if (ec)
+          return fail(ec, "read");
+        self->on_request(parser->release());
+      });
+  }
+
+  // The route takes no body: answer without reading it,
+  // then close since the rest of the stream is unusable
+  void
+    reject_body()
+  {
+    auto res = bad_request(parser_->get(), "Unexpected request body");
+    res.keep_alive(false);
+    queue_(std::move(res));
+  }
+
+  template <class Body>
+  void
+    on_request(http::request<Body>&& req)
+  {
+    if (trace_)
+      trace_span(trace_, trace_stage::parse, stage_begin_, trace_now());
+
     // Send the response
-    handle_request(*doc_root_, parser_->release(), queue_);
+    handle_request(route_, request_context{ state_->doc_root, state_->compressor.get(), state_->chunks.get(), state_->live, state_->background, state_->tracer.get(), trace_ }, std::move(req), queue_);
+    trace_ = 0;
 
     // If we aren't at the queue limit, try to pipeline another request
-    if (!queue_.is_full())
+    if (!queue_.is_full() && !draining_ && !job_ && !deferred_)
+      do_read();
+  }
+
+  // A handler sends the response it deferred, traced
+  // as the request was
+  void
+    on_resume(std::uint64_t trace, std::function<void(queue&)> const& send)
+  {
+    trace_ = trace;
+    send(queue_);
+    trace_ = 0;
+    if (--deferred_ == 0 && !queue_.is_full() && !draining_ && !job_)
       do_read();
   }
 
@@ -658,7 +2528,17 @@ private:
     }
 
     // Inform the queue that a write completed
-    if (queue_.on_write())
+    auto const read = queue_.on_write();
+
+    // Once drained, close instead of waiting for another request
+    if (draining_)
+    {
+      if (queue_.empty())
+        do_close();
+      return;
+    }
+
+    if (read && !job_ && !deferred_)
     {
       // Read another request
       do_read();
@@ -694,6 +2574,10 @@ listener::do_accept()
 void
 listener::on_accept(beast::error_code ec, tcp::socket socket)
 {
+  // The acceptor was closed by stop()
+  if (ec == net::error::operation_aborted || !acceptor_.is_open())
+    return;
+
   if (ec)
   {
     fail(ec, "accept");
@@ -701,11 +2585,14 @@ listener::on_accept(beast::error_code ec, tcp::socket socket)
   else
   {
     spdlog::debug("Accept new connection: total ({})", ++connections);
+    auto const trace = trace_sample();
+    auto const accepted = trace ? trace_now() : 0;
+
     // Create the http session and run it
     std::make_shared<http_session>(
       std::move(socket),
-      doc_root_)
-      ->run();
+      state_)
+      ->run(trace, accepted);
   }
 
   // Accept another connection
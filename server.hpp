@@ -4,6 +4,7 @@
 #include <boost/beast/http.hpp>
 #include <boost/beast/websocket.hpp>
 #include <boost/beast/version.hpp>
+#include <boost/asio/any_io_executor.hpp>
 #include <boost/asio/bind_executor.hpp>
 #include <boost/asio/dispatch.hpp>
 #include <boost/asio/signal_set.hpp>
@@ -12,6 +13,12 @@
 #include <boost/optional.hpp>
 #include <spdlog/spdlog.h>
 #include <spdlog/fmt/ostr.h>
+#include "chunk_cache.hpp"
+#include "compression.hpp"
+#include "drain.hpp"
+#include "live_stream.hpp"
+#include "pacing.hpp"
+#include "tracing.hpp"
 
 namespace beast = boost::beast;         // from <boost/beast.hpp>
 namespace http = beast::http;           // from <boost/beast/http.hpp>
@@ -25,20 +32,36 @@ inline void fail(beast::error_code ec, char const* what)
   spdlog::debug("boost error_code {}:{}", what, ec.message());
 }
 
+// State shared by the listener and every session
+struct server_state
+{
+  std::string doc_root;
+  std::shared_ptr<egress_pacer> pacer;
+  std::shared_ptr<session_registry> sessions;
+  std::shared_ptr<compression_cache> compressor;
+  std::shared_ptr<chunk_cache> chunks;
+  std::shared_ptr<live_ladder> live;
+  std::shared_ptr<screen_capture> capture;
+  std::shared_ptr<trace_config const> tracer;
+
+  // Runs the work which would block the I/O threads
+  net::any_io_executor background;
+};
+
 // Accepts incoming connections and launches the sessions
 class listener : public std::enable_shared_from_this<listener>
 {
   net::io_context& ioc_;
   tcp::acceptor acceptor_;
-  std::shared_ptr<std::string const> doc_root_;
+  std::shared_ptr<server_state const> state_;
   std::uint32_t connections {0};
 
 public:
   listener(
     net::io_context& ioc,
     tcp::endpoint endpoint,
-    std::shared_ptr<std::string const> const& doc_root)
-    : ioc_(ioc), acceptor_(net::make_strand(ioc)), doc_root_(doc_root)
+    std::shared_ptr<server_state const> const& state)
+    : ioc_(ioc), acceptor_(net::make_strand(ioc)), state_(state)
   {
     beast::error_code ec;
 
@@ -76,6 +99,41 @@ public:
     }
   }
 
+  // Adopt a socket which is already bound and listening,
+  // e.g. one handed over by a previous server process.
+  listener(
+    net::io_context& ioc,
+    int native_socket,
+    std::shared_ptr<server_state const> const& state)
+    : ioc_(ioc), acceptor_(net::make_strand(ioc)), state_(state)
+  {
+    beast::error_code ec;
+    acceptor_.assign(tcp::v4(), native_socket, ec);
+    if (ec)
+      fail(ec, "assign");
+  }
+
+  // The listening socket, to hand it over to another process
+  int
+    native_handle()
+  {
+    return acceptor_.native_handle();
+  }
+
+  // Stop accepting connections. Queued connections stay in the
+  // backlog of the socket if another process shares it.
+  void
+    stop()
+  {
+    net::post(
+      acceptor_.get_executor(),
+      [self = this->shared_from_this()]
+      {
+        beast::error_code ec;
+        self->acceptor_.close(ec);
+      });
+  }
+
   // Start accepting incoming connections
   void
     run()
@@ -0,0 +1,260 @@
+// Tests of the chunk cache in front of a slow doc_root: shared misses,
+// stat caching and the scan resistance of S3-FIFO
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <filesystem>
+#include <fstream>
+#include <string>
+#include <vector>
+#include <boost/asio/executor_work_guard.hpp>
+#include <boost/asio/io_context.hpp>
+#include <boost/asio/post.hpp>
+#include "../chunk_cache.hpp"
+
+namespace
+{
+
+int failures = 0;
+
+#define CHECK(cond)                                                   \
+  do                                                                  \
+  {                                                                   \
+    if (!(cond))                                                      \
+    {                                                                 \
+      std::fprintf(stderr, "%s:%d: CHECK(%s)\n", __FILE__, __LINE__, #cond); \
+      ++failures;                                                     \
+    }                                                                 \
+  } while (false)
+
+constexpr std::size_t chunk_size = 4096;
+
+// A directory standing in for doc_root, removed with the object
+struct temp_dir
+{
+  std::filesystem::path path;
+
+  temp_dir()
+  {
+    std::string name = (std::filesystem::temp_directory_path() / "chunk_cache_test.XXXXXX").string();
+    if (!::mkdtemp(&name[0]))
+      std::abort();
+    path = name;
+  }
+
+  ~temp_dir()
+  {
+    std::error_code ec;
+    std::filesystem::remove_all(path, ec);
+  }
+
+  // A file of `size` bytes, each the low byte of its offset
+  std::string
+    write(std::string const& name, std::size_t size) const
+  {
+    std::string data(size, '\0');
+    for (std::size_t i = 0; i < size; ++i)
+      data[i] = static_cast<char>(i);
+    auto const file = (path / name).string();
+    std::ofstream(file, std::ios::binary).write(data.data(), static_cast<std::streamsize>(size));
+    return file;
+  }
+};
+
+double
+seconds(std::chrono::nanoseconds d)
+{
+  return std::chrono::duration<double>(d).count();
+}
+
+// Look a file up on the cache's threads, waiting for the answer
+cached_file
+look_up(chunk_cache& cache, std::string const& path, beast::error_code& ec)
+{
+  net::io_context ioc;
+  cached_file found;
+  cache.async_lookup(path,
+    [&](cached_file file, beast::error_code e)
+    {
+      net::post(ioc,
+        [&, file = std::move(file), e]
+        {
+          found = file;
+          ec = e;
+        });
+    });
+  auto const work = net::make_work_guard(ioc);
+  ioc.run_one();
+  return found;
+}
+
+// Read a chunk, waiting for it
+std::shared_ptr<std::string const>
+read(chunk_cache& cache, cached_file const& file, std::uint64_t index)
+{
+  net::io_context ioc;
+  std::shared_ptr<std::string const> chunk;
+  cache.async_read(file, index, ioc.get_executor(),
+    [&](std::shared_ptr<std::string const> data, beast::error_code)
+    {
+      chunk = std::move(data);
+    });
+  auto const work = net::make_work_guard(ioc);
+  ioc.run_one();
+  return chunk;
+}
+
+// The stat of a file is cached for stat_ttl, a missing file isn't
+void
+test_lookup()
+{
+  temp_dir dir;
+  auto const path = dir.write("a.bin", 3 * chunk_size);
+
+  chunk_cache_config config;
+  config.chunk_size = chunk_size;
+  config.origin_delay = std::chrono::milliseconds(50);
+  chunk_cache cache(config);
+
+  cached_file file;
+  CHECK(!cache.lookup(path, file));
+
+  beast::error_code ec;
+  auto const start = std::chrono::steady_clock::now();
+  file = look_up(cache, path, ec);
+  CHECK(seconds(std::chrono::steady_clock::now() - start) >= 0.05);
+  CHECK(!ec);
+  CHECK(file.path == path);
+  CHECK(file.size == 3 * chunk_size);
+  CHECK(!file.etag.empty());
+
+  cached_file again;
+  CHECK(cache.lookup(path, again));
+  CHECK(again.etag == file.etag);
+
+  look_up(cache, (dir.path / "missing.bin").string(), ec);
+  CHECK(ec == beast::errc::no_such_file_or_directory);
+  look_up(cache, dir.path.string(), ec);
+  CHECK(ec);
+}
+
+// Concurrent misses on a chunk wait for the same read of doc_root
+void
+test_shared_miss()
+{
+  temp_dir dir;
+  auto const path = dir.write("a.bin", 3 * chunk_size);
+
+  chunk_cache_config config;
+  config.chunk_size = chunk_size;
+  config.origin_delay = std::chrono::milliseconds(100);
+  config.threads = 4;
+  chunk_cache cache(config);
+
+  beast::error_code ec;
+  auto const file = look_up(cache, path, ec);
+  CHECK(!ec);
+
+  net::io_context ioc;
+  int const readers = 8;
+  int done = 0;
+  bool same = true;
+  auto const start = std::chrono::steady_clock::now();
+  for (int i = 0; i < readers; ++i)
+    cache.async_read(file, 1, ioc.get_executor(),
+      [&](std::shared_ptr<std::string const> data, beast::error_code e)
+      {
+        ++done;
+        same = same && !e && data && data->size() == chunk_size &&
+          static_cast<unsigned char>((*data)[0]) == (chunk_size & 0xff) &&
+          static_cast<unsigned char>((*data)[1]) == ((chunk_size + 1) & 0xff);
+      });
+  auto const work = net::make_work_guard(ioc);
+  while (done < readers)
+    ioc.run_one();
+  auto const elapsed = seconds(std::chrono::steady_clock::now() - start);
+
+  CHECK(same);
+  auto const stats = cache.stats();
+  CHECK(stats.misses == 1);
+  CHECK(stats.hits == readers - 1);
+
+  // One delay of doc_root, not one per reader
+  CHECK(elapsed >= 0.1 && elapsed < 0.3);
+
+  // Then the chunk is in memory
+  CHECK(cache.find(file, 1) != nullptr);
+  CHECK(cache.stats().misses == 1);
+}
+
+// A file read once from start to end doesn't push out a chunk read often
+void
+test_scan()
+{
+  temp_dir dir;
+  auto const hot_path = dir.write("hot.bin", chunk_size);
+  auto const scan_path = dir.write("scan.bin", 40 * chunk_size);
+
+  chunk_cache_config config;
+  config.chunk_size = chunk_size;
+  config.ram_capacity = 10 * chunk_size;
+  chunk_cache cache(config);
+
+  beast::error_code ec;
+  auto const hot = look_up(cache, hot_path, ec);
+  auto const scan = look_up(cache, scan_path, ec);
+
+  CHECK(read(cache, hot, 0) != nullptr);
+  CHECK(cache.find(hot, 0) != nullptr);
+
+  for (std::uint64_t i = 0; i < 40; ++i)
+    CHECK(read(cache, scan, i) != nullptr);
+
+  CHECK(cache.find(hot, 0) != nullptr);
+  CHECK(cache.find(scan, 0) == nullptr);
+  CHECK(cache.find(scan, 39) != nullptr);
+}
+
+// The same with the eviction alone, then a key evicted from the small
+// FIFO and read again goes to the main one
+void
+test_s3fifo()
+{
+  s3fifo fifo(10);
+  std::vector<std::string> evicted;
+  CHECK(fifo.insert("hot", 1, true, evicted));
+  CHECK(fifo.touch("hot"));
+  for (int i = 0; i < 100; ++i)
+    CHECK(fifo.insert("scan" + std::to_string(i), 1, true, evicted));
+  CHECK(fifo.contains("hot"));
+  CHECK(fifo.size() == 10);
+  CHECK(evicted.size() == 91);
+
+  // "scan89" was evicted not long ago, it is remembered
+  evicted.clear();
+  CHECK(!fifo.contains("scan89"));
+  CHECK(fifo.insert("scan89", 1, true, evicted));
+  for (int i = 100; i < 120; ++i)
+    fifo.insert("scan" + std::to_string(i), 1, true, evicted);
+  CHECK(fifo.contains("scan89"));
+  CHECK(fifo.contains("hot"));
+
+  // Larger than the whole cache
+  CHECK(!fifo.insert("large", 11, true, evicted));
+}
+
+} // namespace
+
+int
+main()
+{
+  test_lookup();
+  test_shared_miss();
+  test_scan();
+  test_s3fifo();
+
+  if (failures)
+    std::fprintf(stderr, "%d check(s) failed\n", failures);
+  return failures ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,273 @@
+// Tests of the HPACK codec and of the Huffman code, with the examples
+// of RFC 7541 Appendix C
+
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include <vector>
+#include "../hpack.hpp"
+
+namespace hpack
+{
+
+bool
+operator==(header_field const& a, header_field const& b)
+{
+  return a.name == b.name && a.value == b.value;
+}
+
+} // namespace hpack
+
+namespace
+{
+
+int failures = 0;
+
+#define CHECK(cond)                                                   \
+  do                                                                  \
+  {                                                                   \
+    if (!(cond))                                                      \
+    {                                                                 \
+      std::fprintf(stderr, "%s:%d: CHECK(%s)\n", __FILE__, __LINE__, #cond); \
+      ++failures;                                                     \
+    }                                                                 \
+  } while (false)
+
+// "8286 8441" to bytes, spaces are ignored
+std::string
+from_hex(char const* hex)
+{
+  std::string out;
+  for (auto const* p = hex; *p; ++p)
+  {
+    if (*p == ' ')
+      continue;
+    out.push_back(static_cast<char>(std::strtoul(std::string(p, 2).c_str(), nullptr, 16)));
+    ++p;
+  }
+  return out;
+}
+
+using fields = std::vector<hpack::header_field>;
+
+bool
+decode(hpack::decoder& d, std::string const& block, fields& out)
+{
+  out.clear();
+  return d.decode(reinterpret_cast<std::uint8_t const*>(block.data()), block.size(), out);
+}
+
+// Decode the header blocks of one connection in order
+void
+check_blocks(hpack::decoder& d, std::vector<std::pair<char const*, fields>> const& blocks)
+{
+  for (auto const& b : blocks)
+  {
+    fields out;
+    CHECK(decode(d, from_hex(b.first), out));
+    CHECK(out == b.second);
+  }
+}
+
+// C.2: one field of each representation
+void
+test_field_representations()
+{
+  hpack::decoder d;
+  check_blocks(d, {
+    { "400a 6375 7374 6f6d 2d6b 6579 0d63 7573 746f 6d2d 6865 6164 6572",
+      { { "custom-key", "custom-header" } } },
+    { "040c 2f73 616d 706c 652f 7061 7468",
+      { { ":path", "/sample/path" } } },
+    { "1008 7061 7373 776f 7264 0673 6563 7265 74",
+      { { "password", "secret" } } },
+    { "82",
+      { { ":method", "GET" } } },
+  });
+
+  // Only the first one was added to the dynamic table, index 62
+  fields out;
+  CHECK(decode(d, from_hex("be"), out));
+  CHECK((out == fields{ { "custom-key", "custom-header" } }));
+  CHECK(!decode(d, from_hex("bf"), out));
+}
+
+fields const request1 = {
+  { ":method", "GET" }, { ":scheme", "http" }, { ":path", "/" }, { ":authority", "www.example.com" } };
+fields const request2 = {
+  { ":method", "GET" }, { ":scheme", "http" }, { ":path", "/" }, { ":authority", "www.example.com" },
+  { "cache-control", "no-cache" } };
+fields const request3 = {
+  { ":method", "GET" }, { ":scheme", "https" }, { ":path", "/index.html" }, { ":authority", "www.example.com" },
+  { "custom-key", "custom-value" } };
+
+// C.3: requests without Huffman coding
+void
+test_requests()
+{
+  hpack::decoder d;
+  check_blocks(d, {
+    { "8286 8441 0f77 7777 2e65 7861 6d70 6c65 2e63 6f6d", request1 },
+    { "8286 84be 5808 6e6f 2d63 6163 6865", request2 },
+    { "8287 85bf 400a 6375 7374 6f6d 2d6b 6579 0c63 7573 746f 6d2d 7661 6c75 65", request3 },
+  });
+}
+
+// C.4: the same requests with Huffman coding
+void
+test_huffman_requests()
+{
+  hpack::decoder d;
+  check_blocks(d, {
+    { "8286 8441 8cf1 e3c2 e5f2 3a6b a0ab 90f4 ff", request1 },
+    { "8286 84be 5886 a8eb 1064 9cbf", request2 },
+    { "8287 85bf 4088 25a8 49e9 5ba9 7d7f 8925 a849 e95b b8e8 b4bf", request3 },
+  });
+}
+
+fields const response1 = {
+  { ":status", "302" }, { "cache-control", "private" }, { "date", "Mon, 21 Oct 2013 20:13:21 GMT" },
+  { "location", "https://www.example.com" } };
+fields const response2 = {
+  { ":status", "307" }, { "cache-control", "private" }, { "date", "Mon, 21 Oct 2013 20:13:21 GMT" },
+  { "location", "https://www.example.com" } };
+fields const response3 = {
+  { ":status", "200" }, { "cache-control", "private" }, { "date", "Mon, 21 Oct 2013 20:13:22 GMT" },
+  { "location", "https://www.example.com" }, { "content-encoding", "gzip" },
+  { "set-cookie", "foo=ASDJKHQKBZXOQWEOPIUAXQWEOIU; max-age=3600; version=1" } };
+
+// C.5: responses without Huffman coding, entries are evicted
+// from a dynamic table of 256 bytes
+void
+test_responses()
+{
+  hpack::decoder d(256);
+  check_blocks(d, {
+    { "4803 3330 3258 0770 7269 7661 7465 611d 4d6f 6e2c 2032 3120 4f63 7420 3230 3133 2032 303a 3133 3a32 3120 474d "
+      "546e 1768 7474 7073 3a2f 2f77 7777 2e65 7861 6d70 6c65 2e63 6f6d", response1 },
+    { "4803 3330 37c1 c0bf", response2 },
+    { "88c1 611d 4d6f 6e2c 2032 3120 4f63 7420 3230 3133 2032 303a 3133 3a32 3220 474d 54c0 5a04 677a 6970 7738 666f "
+      "6f3d 4153 444a 4b48 514b 425a 584f 5157 454f 5049 5541 5851 5745 4f49 553b 206d 6178 2d61 6765 3d33 3630 303b "
+      "2076 6572 7369 6f6e 3d31", response3 },
+  });
+}
+
+// C.6: the same responses with Huffman coding
+void
+test_huffman_responses()
+{
+  hpack::decoder d(256);
+  check_blocks(d, {
+    { "4882 6402 5885 aec3 771a 4b61 96d0 7abe 9410 54d4 44a8 2005 9504 0b81 66e0 82a6 2d1b ff6e 919d 29ad 1718 63c7 "
+      "8f0b 97c8 e9ae 82ae 43d3", response1 },
+    { "4883 640e ffc1 c0bf", response2 },
+    { "88c1 6196 d07a be94 1054 d444 a820 0595 040b 8166 e084 a62d 1bff c05a 839b d9ab 77ad 94e7 821d d7f2 e6c7 b335 "
+      "dfdf cd5b 3960 d5af 2708 7f36 72c1 ab27 0fb5 291f 9587 3160 65c0 03ed 4ee5 b106 3d50 07", response3 },
+  });
+}
+
+void
+test_huffman()
+{
+  // C.4.1
+  auto const coded = from_hex("f1e3 c2e5 f23a 6ba0 ab90 f4ff");
+  std::string out;
+  CHECK(hpack::huffman_decode(reinterpret_cast<std::uint8_t const*>(coded.data()), coded.size(), out));
+  CHECK(out == "www.example.com");
+  out.clear();
+  hpack::huffman_encode("www.example.com", out);
+  CHECK(out == coded);
+  CHECK(hpack::huffman_size("www.example.com") == coded.size());
+
+  // Every octet, including those with codes of 30 bits
+  std::string all;
+  for (int i = 0; i < 256; ++i)
+    all.push_back(static_cast<char>(i));
+  std::string encoded;
+  hpack::huffman_encode(all, encoded);
+  CHECK(hpack::huffman_size(all) == encoded.size());
+  std::string decoded;
+  CHECK(hpack::huffman_decode(reinterpret_cast<std::uint8_t const*>(encoded.data()), encoded.size(), decoded));
+  CHECK(decoded == all);
+
+  // Padding that isn't the start of EOS, padding longer than 7 bits,
+  // and EOS itself are errors (RFC 7541 section 5.2)
+  for (auto const* bad : { "00", "1fff", "ffff ffff" })
+  {
+    auto const b = from_hex(bad);
+    out.clear();
+    CHECK(!hpack::huffman_decode(reinterpret_cast<std::uint8_t const*>(b.data()), b.size(), out));
+  }
+}
+
+// What the encoder writes, a decoder reads back
+void
+test_round_trip()
+{
+  hpack::encoder e;
+  hpack::decoder d;
+  fields const response = {
+    { ":status", "200" }, { "server", "Boost.Beast/300" }, { "content-type", "video/mp4" },
+    { "etag", "\"ce8021-18dfccce54d05641-1312d00\"" }, { "content-length", "20000000" },
+    { "x-binary", std::string("\0\x7f\x80\xff", 4) } };
+
+  std::size_t first = 0;
+  for (int i = 0; i < 3; ++i)
+  {
+    auto const block = e.encode(response);
+    fields out;
+    CHECK(decode(d, block, out));
+    CHECK(out == response);
+    if (i == 0)
+      first = block.size();
+    else
+      CHECK(block.size() < first); // indexed from the dynamic table
+  }
+
+  // A smaller table is announced in the next block
+  e.set_max_table_size(0);
+  auto const block = e.encode(response);
+  CHECK(!block.empty() && (static_cast<std::uint8_t>(block[0]) & 0xe0) == 0x20);
+  fields out;
+  CHECK(decode(d, block, out));
+  CHECK(out == response);
+}
+
+// Malformed header blocks are compression errors
+void
+test_errors()
+{
+  for (auto const* bad : {
+    "80",             // index 0
+    "be",             // empty dynamic table
+    "ff",             // truncated integer
+    "ff80 8080 8080 8080 8080 01", // integer overflow
+    "400a 6375 7374", // truncated string
+    "3fe2 1f",        // table size update above our maximum
+    "82 3fe1 1f",     // table size update after a field
+  })
+  {
+    hpack::decoder d;
+    fields out;
+    CHECK(!decode(d, from_hex(bad), out));
+  }
+}
+
+} // namespace
+
+int
+main()
+{
+  test_field_representations();
+  test_requests();
+  test_huffman_requests();
+  test_responses();
+  test_huffman_responses();
+  test_huffman();
+  test_round_trip();
+  test_errors();
+
+  if (failures)
+    std::fprintf(stderr, "%d check(s) failed\n", failures);
+  return failures ? EXIT_FAILURE : EXIT_SUCCESS;
+}
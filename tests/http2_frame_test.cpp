@@ -0,0 +1,136 @@
+// Tests of the HTTP/2 frame parser
+
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include <vector>
+#include "../http2_frame.hpp"
+
+namespace
+{
+
+int failures = 0;
+
+#define CHECK(cond)                                                   \
+  do                                                                  \
+  {                                                                   \
+    if (!(cond))                                                      \
+    {                                                                 \
+      std::fprintf(stderr, "%s:%d: CHECK(%s)\n", __FILE__, __LINE__, #cond); \
+      ++failures;                                                     \
+    }                                                                 \
+  } while (false)
+
+std::uint8_t const*
+bytes(std::string const& s)
+{
+  return reinterpret_cast<std::uint8_t const*>(s.data());
+}
+
+void
+test_round_trip()
+{
+  for (std::size_t length : { 0, 1, 255, 256, 16384, 16777215 })
+  {
+    auto const h = http2::serialize_frame_header(0x1, 0x25, 0x7fffffff, length);
+    CHECK(h.size() == http2::frame_header_size);
+    http2::frame_header out{};
+    auto const frame = h + std::string(length, 'x');
+    CHECK(http2::parse_frame(bytes(frame), frame.size(), 16777215, out) == http2::parse_result::complete);
+    CHECK(out.length == length);
+    CHECK(out.type == 0x1);
+    CHECK(out.flags == 0x25);
+    CHECK(out.stream_id == 0x7fffffff);
+  }
+}
+
+void
+test_parse()
+{
+  // RFC 9113 section 6.5.3: a SETTINGS ack on stream 0
+  std::string const ack("\x00\x00\x00\x04\x01\x00\x00\x00\x00", 9);
+  http2::frame_header h{};
+  CHECK(http2::parse_frame(bytes(ack), ack.size(), 16384, h) == http2::parse_result::complete);
+  CHECK(h.length == 0 && h.type == 0x4 && h.flags == 0x1 && h.stream_id == 0);
+
+  // The reserved bit is ignored
+  std::string const reserved("\x00\x00\x00\x00\x00\x80\x00\x00\x03", 9);
+  CHECK(http2::parse_frame(bytes(reserved), reserved.size(), 16384, h) == http2::parse_result::complete);
+  CHECK(h.stream_id == 3);
+
+  // A header or a payload cut short waits for more bytes
+  auto const data = http2::serialize_frame_header(0x0, 0x1, 1, 5) + "hello";
+  for (std::size_t size = 0; size < data.size(); ++size)
+    CHECK(http2::parse_frame(bytes(data), size, 16384, h) == http2::parse_result::incomplete);
+  CHECK(http2::parse_frame(bytes(data), data.size(), 16384, h) == http2::parse_result::complete);
+
+  // The size is checked as soon as the header is there
+  auto const large = http2::serialize_frame_header(0x0, 0x0, 1, 16385);
+  CHECK(http2::parse_frame(bytes(large), large.size(), 16384, h) == http2::parse_result::too_large);
+  CHECK(http2::parse_frame(bytes(large), large.size(), 16385, h) == http2::parse_result::incomplete);
+}
+
+// Consecutive frames are split where their lengths say
+void
+test_frames_in_a_buffer()
+{
+  std::string buffer;
+  buffer += http2::serialize_frame_header(0x1, 0x4, 1, 3) + "abc";
+  buffer += http2::serialize_frame_header(0x0, 0x1, 1, 0);
+  buffer += http2::serialize_frame_header(0x8, 0x0, 0, 4) + std::string("\x00\x00\x10\x00", 4);
+  buffer += http2::serialize_frame_header(0x6, 0x0, 0, 8).substr(0, 4);
+
+  std::vector<http2::frame_header> frames;
+  std::size_t pos = 0;
+  http2::frame_header h{};
+  while (http2::parse_frame(bytes(buffer) + pos, buffer.size() - pos, 16384, h) == http2::parse_result::complete)
+  {
+    frames.push_back(h);
+    pos += http2::frame_header_size + h.length;
+  }
+  CHECK(frames.size() == 3);
+  CHECK(pos == buffer.size() - 4);
+  CHECK(frames.size() == 3 && frames[0].type == 0x1 && frames[1].type == 0x0 && frames[2].type == 0x8);
+  CHECK(frames.size() == 3 && frames[2].length == 4 && frames[2].stream_id == 0);
+}
+
+void
+test_padding()
+{
+  // Pad length, data, padding
+  std::string const padded("\x03" "data" "\x00\x00\x00", 8);
+  auto const* p = bytes(padded);
+  std::size_t length = padded.size();
+  CHECK(http2::strip_padding(p, length));
+  CHECK(std::string(reinterpret_cast<char const*>(p), length) == "data");
+
+  // Nothing but padding
+  std::string const empty("\x02\x00\x00", 3);
+  p = bytes(empty);
+  length = empty.size();
+  CHECK(http2::strip_padding(p, length));
+  CHECK(length == 0);
+
+  // No pad length, or padding as long as the payload (RFC 9113 section 6.1)
+  for (auto const& bad : { std::string(), std::string("\x01", 1), std::string("\x04" "abc", 4) })
+  {
+    p = bytes(bad);
+    length = bad.size();
+    CHECK(!http2::strip_padding(p, length));
+  }
+}
+
+} // namespace
+
+int
+main()
+{
+  test_round_trip();
+  test_parse();
+  test_frames_in_a_buffer();
+  test_padding();
+
+  if (failures)
+    std::fprintf(stderr, "%d check(s) failed\n", failures);
+  return failures ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,153 @@
+// Tests of the token bucket and of the deficit round robin
+// of the fair scheduler
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <thread>
+#include <vector>
+#include "../pacing.hpp"
+
+namespace
+{
+
+int failures = 0;
+
+#define CHECK(cond)                                                   \
+  do                                                                  \
+  {                                                                   \
+    if (!(cond))                                                      \
+    {                                                                 \
+      std::fprintf(stderr, "%s:%d: CHECK(%s)\n", __FILE__, __LINE__, #cond); \
+      ++failures;                                                     \
+    }                                                                 \
+  } while (false)
+
+double
+seconds(std::chrono::nanoseconds d)
+{
+  return std::chrono::duration<double>(d).count();
+}
+
+void
+test_token_bucket()
+{
+  // 1000 bytes/s with a burst of 1000 bytes
+  token_bucket bucket(1000, 1000);
+
+  // The burst goes through at once
+  CHECK(bucket.consume(600) == std::chrono::nanoseconds::zero());
+  CHECK(bucket.consume(400) == std::chrono::nanoseconds::zero());
+
+  // Then the bucket goes into debt, and the wait grows with it
+  auto const first = seconds(bucket.consume(500));
+  CHECK(first > 0.45 && first <= 0.5);
+  auto const second = seconds(bucket.consume(500));
+  CHECK(second > 0.95 && second <= 1.0);
+
+  // A write larger than the burst isn't refused, it waits longer
+  token_bucket large(1000, 100);
+  auto const wait = seconds(large.consume(2100));
+  CHECK(wait > 1.95 && wait <= 2.0);
+}
+
+void
+test_token_bucket_refill()
+{
+  token_bucket bucket(100000, 1000);
+  CHECK(bucket.consume(1000) == std::chrono::nanoseconds::zero());
+  CHECK(bucket.consume(1) > std::chrono::nanoseconds::zero());
+
+  // 20 ms refill 2000 bytes, capped at the burst
+  std::this_thread::sleep_for(std::chrono::milliseconds(20));
+  CHECK(bucket.consume(1000) == std::chrono::nanoseconds::zero());
+  CHECK(bucket.consume(100) > std::chrono::nanoseconds::zero());
+}
+
+// Grants of 1000 bytes on a 1 MB/s link: once every class is backlogged,
+// each round gives them 8, 4 and 1 grants
+void
+test_fair_scheduler()
+{
+  net::io_context ioc;
+  auto scheduler = std::make_shared<fair_scheduler>(ioc, 1000000, 1000);
+
+  std::vector<traffic_class> order;
+  auto const acquire =
+    [&](traffic_class cls, int count)
+    {
+      for (int i = 0; i < count; ++i)
+        scheduler->async_acquire(cls, 1000, ioc.get_executor(),
+          [&order, cls]
+          {
+            order.push_back(cls);
+          });
+    };
+  acquire(traffic_class::bulk, 30);
+  acquire(traffic_class::early_range, 30);
+  acquire(traffic_class::live, 30);
+
+  auto const start = std::chrono::steady_clock::now();
+  ioc.run();
+  auto const elapsed = seconds(std::chrono::steady_clock::now() - start);
+
+  CHECK(order.size() == 90);
+
+  // The first bulk grant is served before the others queue up, then
+  // every round of 13 grants holds 8 live, 4 early and 1 bulk
+  std::size_t counts[3] = { 0, 0, 0 };
+  for (std::size_t i = 1; i < 1 + 26 && i < order.size(); ++i)
+    ++counts[static_cast<std::size_t>(order[i])];
+  CHECK(counts[static_cast<std::size_t>(traffic_class::live)] == 16);
+  CHECK(counts[static_cast<std::size_t>(traffic_class::early_range)] == 8);
+  CHECK(counts[static_cast<std::size_t>(traffic_class::bulk)] == 2);
+
+  // Live grants are all served before most bulk ones
+  std::size_t last_live = 0;
+  std::size_t bulk_before = 0;
+  for (std::size_t i = 0; i < order.size(); ++i)
+    if (order[i] == traffic_class::live)
+      last_live = i;
+  for (std::size_t i = 0; i < last_live; ++i)
+    if (order[i] == traffic_class::bulk)
+      ++bulk_before;
+  CHECK(bulk_before <= 5);
+
+  // 90 kB at 1 MB/s, less the burst let through on an idle link
+  CHECK(elapsed > 0.08);
+}
+
+// A class alone on the link gets all of it
+void
+test_fair_scheduler_idle()
+{
+  net::io_context ioc;
+  auto scheduler = std::make_shared<fair_scheduler>(ioc, 1000000, 1000);
+  int granted = 0;
+  for (int i = 0; i < 20; ++i)
+    scheduler->async_acquire(traffic_class::bulk, 1000, ioc.get_executor(),
+      [&granted]
+      {
+        ++granted;
+      });
+  auto const start = std::chrono::steady_clock::now();
+  ioc.run();
+  auto const elapsed = seconds(std::chrono::steady_clock::now() - start);
+  CHECK(granted == 20);
+  CHECK(elapsed > 0.015 && elapsed < 0.5);
+}
+
+} // namespace
+
+int
+main()
+{
+  test_token_bucket();
+  test_token_bucket_refill();
+  test_fair_scheduler();
+  test_fair_scheduler_idle();
+
+  if (failures)
+    std::fprintf(stderr, "%d check(s) failed\n", failures);
+  return failures ? EXIT_FAILURE : EXIT_SUCCESS;
+}
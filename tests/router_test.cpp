@@ -0,0 +1,146 @@
+// Tests of the compile-time route table, with the routes of the server
+
+#include <cstdio>
+#include <cstdlib>
+#include <ostream> // needed by boost/beast/http/verb.hpp
+#include <string_view>
+#include "../router.hpp"
+
+namespace
+{
+
+int failures = 0;
+
+#define CHECK(cond)                                                   \
+  do                                                                  \
+  {                                                                   \
+    if (!(cond))                                                      \
+    {                                                                 \
+      std::fprintf(stderr, "%s:%d: CHECK(%s)\n", __FILE__, __LINE__, #cond); \
+      ++failures;                                                     \
+    }                                                                 \
+  } while (false)
+
+using boost::beast::http::verb;
+
+struct stream_route
+{
+  static constexpr std::string_view path = "/stream";
+  static constexpr bool prefix = false;
+  static constexpr std::uint64_t methods = method_bit(verb::get) | method_bit(verb::head);
+};
+
+struct trace_route
+{
+  static constexpr std::string_view path = "/admin/trace";
+  static constexpr bool prefix = false;
+  static constexpr std::uint64_t methods = method_bit(verb::get) | method_bit(verb::post);
+};
+
+struct file_route
+{
+  static constexpr std::string_view path = "/";
+  static constexpr bool prefix = true;
+  static constexpr std::uint64_t methods = method_bit(verb::get) | method_bit(verb::head);
+};
+
+using routes = router<stream_route, trace_route, file_route>;
+
+enum : int
+{
+  stream = 0,
+  trace = 1,
+  file = 2,
+  none = -1
+};
+
+// Matching is usable in constant expressions
+static_assert(routes::find("/stream") == stream, "exact route");
+static_assert(routes::find("/video.mp4") == file, "prefix route");
+
+void
+test_find()
+{
+  struct
+  {
+    char const* target;
+    int route;
+  } const table[] = {
+    { "/", file },
+    { "/stream", stream },
+    { "/stream?q=low", stream },
+    { "/streamx", file },     // an exact route doesn't match longer paths
+    { "/stream/", file },
+    { "/strea", file },       // nor shorter ones
+    { "/admin/trace", trace },
+    { "/admin/trace?action=start", trace },
+    { "/admin/trace/x", file },
+    { "/admin", file },
+    { "/index.html", file },
+    { "/\xc3\xa9t\xc3\xa9.mp4", file }, // bytes above 127 have no transition
+    { "", none },
+    { "stream", none },       // not below "/"
+    { "*", none },
+  };
+  for (auto const& row : table)
+  {
+    auto const found = routes::find(row.target);
+    if (found != row.route)
+      std::fprintf(stderr, "find(\"%s\") = %d, expected %d\n", row.target, found, row.route);
+    CHECK(found == row.route);
+  }
+}
+
+// The handler of a route only gets the methods of its mask
+bool
+allows(std::string_view target, verb method)
+{
+  bool allowed = false;
+  routes::visit(routes::find(target),
+    [&](auto tag)
+    {
+      using route_type = typename decltype(tag)::type;
+      allowed = (route_type::methods & method_bit(method)) != 0;
+    });
+  return allowed;
+}
+
+void
+test_methods()
+{
+  CHECK(allows("/stream", verb::get));
+  CHECK(allows("/stream", verb::head));
+  CHECK(!allows("/stream", verb::post));
+  CHECK(allows("/admin/trace?action=stop", verb::post));
+  CHECK(!allows("/admin/trace", verb::delete_));
+  CHECK(allows("/streamx", verb::head));
+  CHECK(!allows("/index.html", verb::put));
+  CHECK(!allows("/", verb::options));
+}
+
+// Visiting reaches the route at the index
+void
+test_visit()
+{
+  std::string_view path;
+  routes::visit(trace,
+    [&](auto tag)
+    {
+      path = decltype(tag)::type::path;
+    });
+  CHECK(path == "/admin/trace");
+}
+
+} // namespace
+
+int
+main()
+{
+  test_find();
+  test_methods();
+  test_visit();
+
+  if (failures)
+    std::fprintf(stderr, "%d check(s) failed\n", failures);
+  return failures ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,210 @@
+// Writes JPEG frames into a frame_ring in POSIX shared memory, for
+// running the server's shared memory ingest without a camera.
+//
+// Usage: shm_producer <shm name> [fps] [frame.jpg ...]
+//
+// The given JPEG files are sent in a loop; without files a moving test
+// pattern is encoded with libjpeg.
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <csignal>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iterator>
+#include <string>
+#include <thread>
+#include <vector>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#include <jpeglib.h>
+#include "../frame_ring.hpp"
+
+namespace
+{
+
+constexpr std::uint32_t slot_count = 8;
+constexpr std::uint32_t slot_capacity = 2 * 1024 * 1024;
+
+std::atomic<bool> stop{ false };
+
+// Encode a frame of the test pattern: moving color bars
+// and a bar growing with the frame number.
+std::vector<std::uint8_t>
+encode_test_frame(std::uint64_t n, int width, int height)
+{
+  std::vector<std::uint8_t> rgb(static_cast<std::size_t>(width) * height * 3);
+  for (int y = 0; y < height; ++y)
+  {
+    for (int x = 0; x < width; ++x)
+    {
+      auto* p = &rgb[(static_cast<std::size_t>(y) * width + x) * 3];
+      int const bar = ((x + static_cast<int>(n) * 4) / (width / 8)) % 8;
+      p[0] = bar & 1 ? 255 : 0;
+      p[1] = bar & 2 ? 255 : 0;
+      p[2] = bar & 4 ? 255 : 0;
+      if (y > height - 24 && x < static_cast<int>(n % 256) * width / 256)
+        p[0] = p[1] = p[2] = 255;
+    }
+  }
+
+  jpeg_compress_struct cinfo;
+  jpeg_error_mgr jerr;
+  cinfo.err = jpeg_std_error(&jerr);
+  jpeg_create_compress(&cinfo);
+
+  unsigned char* out = nullptr;
+  unsigned long size = 0;
+  jpeg_mem_dest(&cinfo, &out, &size);
+  cinfo.image_width = width;
+  cinfo.image_height = height;
+  cinfo.input_components = 3;
+  cinfo.in_color_space = JCS_RGB;
+  jpeg_set_defaults(&cinfo);
+  jpeg_set_quality(&cinfo, 80, TRUE);
+  jpeg_start_compress(&cinfo, TRUE);
+  while (cinfo.next_scanline < cinfo.image_height)
+  {
+    JSAMPROW row = &rgb[static_cast<std::size_t>(cinfo.next_scanline) * width * 3];
+    jpeg_write_scanlines(&cinfo, &row, 1);
+  }
+  jpeg_finish_compress(&cinfo);
+  jpeg_destroy_compress(&cinfo);
+
+  std::vector<std::uint8_t> jpeg(out, out + size);
+  std::free(out);
+  return jpeg;
+}
+
+// Map the ring, creating or re-initializing it if needed
+frame_ring::ring_header*
+open_ring(char const* name)
+{
+  int const fd = ::shm_open(name, O_RDWR | O_CREAT, 0600);
+  if (fd < 0)
+  {
+    std::perror("shm_open");
+    return nullptr;
+  }
+  auto const size = frame_ring::mapping_size(slot_count, slot_capacity);
+  if (::ftruncate(fd, size) != 0)
+  {
+    std::perror("ftruncate");
+    ::close(fd);
+    return nullptr;
+  }
+  void* addr = ::mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  ::close(fd);
+  if (addr == MAP_FAILED)
+  {
+    std::perror("mmap");
+    return nullptr;
+  }
+
+  auto* ring = static_cast<frame_ring::ring_header*>(addr);
+  if (ring->magic != frame_ring::magic ||
+    ring->version != frame_ring::version ||
+    ring->slot_count != slot_count ||
+    ring->slot_capacity != slot_capacity)
+  {
+    std::memset(addr, 0, size);
+    ring->version = frame_ring::version;
+    ring->slot_count = slot_count;
+    ring->slot_capacity = slot_capacity;
+    ring->published.store(0);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    ring->magic = frame_ring::magic;
+  }
+  return ring;
+}
+
+// Write one frame, returns `false` if every slot is pinned by the server
+bool
+publish(frame_ring::ring_header* ring, std::uint64_t n, std::vector<std::uint8_t> const& jpeg)
+{
+  auto* const slots = frame_ring::slots(ring);
+  auto const last = static_cast<std::uint32_t>(ring->published.load() & 0xff);
+
+  for (std::uint32_t i = 1; i <= ring->slot_count; ++i)
+  {
+    auto const slot = (last + i) % ring->slot_count;
+    auto& header = slots[slot];
+    if (header.readers.load() != 0)
+      continue;
+
+    // Claim the slot, then make sure the server didn't pin it meanwhile
+    auto const previous = header.seq.load();
+    header.seq.store(n * 2 + 1);
+    if (header.readers.load() != 0)
+    {
+      header.seq.store(previous);
+      continue;
+    }
+
+    std::memcpy(frame_ring::slot_data(ring, slot), jpeg.data(), jpeg.size());
+    header.size = static_cast<std::uint32_t>(jpeg.size());
+    header.seq.store(n * 2);
+    ring->published.store(n << 8 | slot);
+    return true;
+  }
+  return false;
+}
+
+} // namespace
+
+int main(int argc, char* argv[])
+{
+  if (argc < 2)
+  {
+    std::fprintf(stderr, "Usage: shm_producer <shm name> [fps] [frame.jpg ...]\n");
+    return EXIT_FAILURE;
+  }
+  double const fps = argc > 2 ? std::max(0.1, std::atof(argv[2])) : 30;
+
+  std::vector<std::vector<std::uint8_t>> files;
+  for (int i = 3; i < argc; ++i)
+  {
+    std::ifstream file(argv[i], std::ios::binary);
+    files.emplace_back(std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>());
+    if (files.back().empty() || files.back().size() > slot_capacity)
+    {
+      std::fprintf(stderr, "Can't use %s\n", argv[i]);
+      return EXIT_FAILURE;
+    }
+  }
+
+  auto* const ring = open_ring(argv[1]);
+  if (!ring)
+    return EXIT_FAILURE;
+
+  std::signal(SIGINT, [](int) { stop = true; });
+  std::signal(SIGTERM, [](int) { stop = true; });
+
+  // Continue the sequence of a previous run so the server sees new frames
+  std::uint64_t n = ring->published.load() >> 8;
+  auto const period = std::chrono::duration<double>(1.0 / fps);
+  auto next = std::chrono::steady_clock::now();
+  std::uint64_t dropped = 0;
+
+  while (!stop)
+  {
+    ++n;
+    auto const jpeg = files.empty()
+      ? encode_test_frame(n, 640, 360)
+      : files[n % files.size()];
+    if (!publish(ring, n, jpeg))
+      ++dropped;
+    if (n % static_cast<std::uint64_t>(fps * 10 + 1) == 0)
+      std::printf("frame %llu (%zu bytes), %llu dropped\n",
+        static_cast<unsigned long long>(n), jpeg.size(),
+        static_cast<unsigned long long>(dropped));
+
+    next += std::chrono::duration_cast<std::chrono::steady_clock::duration>(period);
+    std::this_thread::sleep_until(next);
+  }
+  return EXIT_SUCCESS;
+}
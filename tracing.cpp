@@ -0,0 +1,243 @@
+#include <algorithm>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+#include <spdlog/fmt/fmt.h>
+#include "tracing.hpp"
+
+namespace
+{
+
+struct span
+{
+  std::uint64_t trace;
+  std::uint64_t begin;
+  std::uint64_t end;
+  trace_stage stage;
+};
+
+// The spans recorded by one thread. Only the export contends for its mutex.
+struct span_ring
+{
+  std::mutex mutex;
+  std::vector<span> spans;
+  std::size_t next = 0;
+  bool wrapped = false;
+  std::uint32_t thread = 0;
+};
+
+struct tracer
+{
+  std::mutex mutex;
+  std::vector<std::shared_ptr<span_ring>> rings;
+  trace_config config;
+  std::atomic<std::uint64_t> sample{ 100 };
+  std::atomic<std::uint64_t> requests{ 0 };
+
+  // When tracing started, to convert ticks to time
+  std::uint64_t epoch_ticks = 0;
+  std::chrono::steady_clock::time_point epoch_time;
+};
+
+tracer&
+the_tracer()
+{
+  static tracer t;
+  return t;
+}
+
+// The ring of the calling thread, registered on first use. It outlives
+// the thread, so the spans of a finished thread are still exported.
+span_ring&
+local_ring()
+{
+  thread_local std::shared_ptr<span_ring> const ring =
+    []
+    {
+      auto& t = the_tracer();
+      auto r = std::make_shared<span_ring>();
+      std::lock_guard<std::mutex> lock(t.mutex);
+      r->spans.resize(t.config.buffer);
+      r->thread = static_cast<std::uint32_t>(t.rings.size() + 1);
+      t.rings.push_back(r);
+      return r;
+    }();
+  return *ring;
+}
+
+char const*
+stage_name(trace_stage stage)
+{
+  switch (stage)
+  {
+  case trace_stage::accept: return "accept";
+  case trace_stage::dispatch: return "dispatch";
+  case trace_stage::parse: return "parse";
+  case trace_stage::open: return "open";
+  case trace_stage::read: return "read";
+  case trace_stage::queue: return "queue";
+  case trace_stage::write: return "write";
+  }
+  return "unknown";
+}
+
+} // namespace
+
+std::uint64_t
+detail::trace_sample_slow()
+{
+  auto& t = the_tracer();
+  auto const n = t.requests.fetch_add(1, std::memory_order_relaxed) + 1;
+  auto const sample = t.sample.load(std::memory_order_relaxed);
+  if (sample > 1 && n % sample != 0)
+    return 0;
+  return n;
+}
+
+void
+trace_span(std::uint64_t trace, trace_stage stage, std::uint64_t begin, std::uint64_t end)
+{
+  if (!trace)
+    return;
+  auto& ring = local_ring();
+  std::lock_guard<std::mutex> lock(ring.mutex);
+  if (ring.spans.empty())
+    return;
+  ring.spans[ring.next] = span{ trace, begin, end, stage };
+  if (++ring.next == ring.spans.size())
+  {
+    ring.next = 0;
+    ring.wrapped = true;
+  }
+}
+
+void
+start_tracing(trace_config const& config)
+{
+  auto& t = the_tracer();
+  std::lock_guard<std::mutex> lock(t.mutex);
+  t.config = config;
+  t.sample = std::max<std::uint64_t>(1, config.sample);
+  for (auto const& ring : t.rings)
+  {
+    std::lock_guard<std::mutex> ring_lock(ring->mutex);
+    ring->spans.assign(config.buffer, span{});
+    ring->next = 0;
+    ring->wrapped = false;
+  }
+  t.epoch_ticks = trace_now();
+  t.epoch_time = std::chrono::steady_clock::now();
+  detail::trace_enabled = true;
+}
+
+void
+stop_tracing()
+{
+  detail::trace_enabled = false;
+}
+
+bool
+tracing()
+{
+  return detail::trace_enabled;
+}
+
+std::string
+export_trace()
+{
+  auto& t = the_tracer();
+  std::vector<std::shared_ptr<span_ring>> rings;
+  std::uint64_t epoch_ticks;
+  std::chrono::steady_clock::time_point epoch_time;
+  {
+    // Only copied under the lock, threads registering their ring wait for it
+    std::lock_guard<std::mutex> lock(t.mutex);
+    rings = t.rings;
+    epoch_ticks = t.epoch_ticks;
+    epoch_time = t.epoch_time;
+  }
+
+  // Ticks per microsecond, measured over the time traced
+  auto const ticks = trace_now() - epoch_ticks;
+  auto const elapsed = std::chrono::duration<double, std::micro>(
+    std::chrono::steady_clock::now() - epoch_time).count();
+  auto const rate = elapsed > 0 && ticks > 0 ? ticks / elapsed : 1.0;
+  auto const to_us =
+    [&](std::uint64_t tick)
+    {
+      return static_cast<double>(tick - epoch_ticks) / rate;
+    };
+
+  struct recorded
+  {
+    span s;
+    std::uint32_t thread;
+  };
+  std::vector<recorded> spans;
+  for (auto const& ring : rings)
+  {
+    std::lock_guard<std::mutex> ring_lock(ring->mutex);
+    auto const count = ring->wrapped ? ring->spans.size() : ring->next;
+    for (std::size_t i = 0; i < count; ++i)
+      if (ring->spans[i].begin >= epoch_ticks)
+        spans.push_back({ ring->spans[i], ring->thread });
+  }
+
+  // A request spans from its first stage to its last one
+  std::unordered_map<std::uint64_t, std::pair<std::uint64_t, std::uint64_t>> requests;
+  for (auto const& r : spans)
+  {
+    auto const it = requests.emplace(r.s.trace, std::make_pair(r.s.begin, r.s.end)).first;
+    it->second.first = std::min(it->second.first, r.s.begin);
+    it->second.second = std::max(it->second.second, r.s.end);
+  }
+
+  // Async events nest by time, so at equal timestamps stages end before
+  // their request ends, and requests begin before their first stage
+  struct event
+  {
+    double ts;
+    int order;
+    std::string json;
+  };
+  std::vector<event> events;
+  events.reserve(spans.size() * 2 + requests.size() * 2);
+  for (auto const& r : requests)
+  {
+    auto const begin = to_us(r.second.first);
+    auto const end = to_us(r.second.second);
+    events.push_back({ begin, 2, fmt::format(
+      R"({{"name":"request","cat":"request","ph":"b","id":"0x{:x}","ts":{:.3f},"pid":1,"tid":0,"args":{{"request":{}}}}})",
+      r.first, begin, r.first) });
+    events.push_back({ end, 1, fmt::format(
+      R"({{"name":"request","cat":"request","ph":"e","id":"0x{:x}","ts":{:.3f},"pid":1,"tid":0}})",
+      r.first, end) });
+  }
+  for (auto const& r : spans)
+  {
+    auto const begin = to_us(r.s.begin);
+    auto const end = to_us(r.s.end);
+    events.push_back({ begin, 3, fmt::format(
+      R"({{"name":"{}","cat":"request","ph":"b","id":"0x{:x}","ts":{:.3f},"pid":1,"tid":{},"args":{{"thread":{}}}}})",
+      stage_name(r.s.stage), r.s.trace, begin, r.thread, r.thread) });
+    events.push_back({ end, 0, fmt::format(
+      R"({{"name":"{}","cat":"request","ph":"e","id":"0x{:x}","ts":{:.3f},"pid":1,"tid":{}}})",
+      stage_name(r.s.stage), r.s.trace, end, r.thread) });
+  }
+  std::sort(events.begin(), events.end(),
+    [](event const& a, event const& b)
+    {
+      return a.ts != b.ts ? a.ts < b.ts : a.order < b.order;
+    });
+
+  std::string out = R"({"displayTimeUnit":"ns","traceEvents":[)";
+  out += R"({"name":"process_name","ph":"M","pid":1,"args":{"name":"file_server"}})";
+  for (auto const& e : events)
+  {
+    out += ",\n";
+    out += e.json;
+  }
+  out += "]}\n";
+  return out;
+}
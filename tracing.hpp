@@ -0,0 +1,109 @@
+#pragma once
+
+// Sampled tracing of the stages of a request, exported as
+// Chrome trace JSON to be viewed in Perfetto (ui.perfetto.dev)
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <string>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+enum class trace_stage : std::uint8_t
+{
+  accept,   // the accepted socket is set up and its session started
+  dispatch, // the session waits for its strand
+  parse,    // the request header is received from its first byte, parsed and routed
+  open,     // the file is opened
+  read,     // the file is read
+  queue,    // the response waits for the previous ones to be sent
+  write     // the response is written to the socket
+};
+
+struct trace_config
+{
+  // One request in `sample` is traced
+  std::uint64_t sample = 100;
+
+  // Spans kept per thread, the oldest are overwritten
+  std::size_t buffer = 64 * 1024;
+};
+
+namespace detail
+{
+inline std::atomic<bool> trace_enabled{ false };
+
+std::uint64_t
+trace_sample_slow();
+} // namespace detail
+
+// Timestamp in TSC ticks, converted to time when exporting. The TSC is
+// assumed to be invariant and synchronized across cores, as on every
+// x86 CPU of the last decade; elsewhere the steady clock is used.
+inline std::uint64_t
+trace_now()
+{
+#if defined(__x86_64__) || defined(__i386__)
+  return __rdtsc();
+#else
+  return static_cast<std::uint64_t>(
+    std::chrono::steady_clock::now().time_since_epoch().count());
+#endif
+}
+
+// Returns the id of a new traced request, or 0 if the request isn't
+// sampled. While tracing is off this costs a relaxed load, and every
+// other call does nothing given a 0 id.
+inline std::uint64_t
+trace_sample()
+{
+  if (!detail::trace_enabled.load(std::memory_order_relaxed))
+    return 0;
+  return detail::trace_sample_slow();
+}
+
+// Record a stage of a traced request into the ring of the calling thread
+void
+trace_span(std::uint64_t trace, trace_stage stage, std::uint64_t begin, std::uint64_t end);
+
+// Records a stage from its construction to its destruction
+class trace_scope
+{
+  std::uint64_t trace_;
+  trace_stage stage_;
+  std::uint64_t begin_;
+
+public:
+  trace_scope(std::uint64_t trace, trace_stage stage)
+    : trace_(trace), stage_(stage), begin_(trace ? trace_now() : 0)
+  {
+  }
+
+  trace_scope(trace_scope const&) = delete;
+  trace_scope& operator=(trace_scope const&) = delete;
+
+  ~trace_scope()
+  {
+    if (trace_)
+      trace_span(trace_, stage_, begin_, trace_now());
+  }
+};
+
+// Drop the spans recorded so far and start sampling requests
+void
+start_tracing(trace_config const& config);
+
+// Stop sampling, the spans are kept for the export
+void
+stop_tracing();
+
+bool
+tracing();
+
+// The spans recorded since tracing started, as Chrome trace JSON.
+// Every request is an async track holding its stages. This takes a
+// while with large buffers, it is called off the I/O threads.
+std::string
+export_trace();